@@ -0,0 +1,288 @@
+// soupstock - a soupbintcp library
+//
+// Copyright 2025 Krister Joas
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include "base_session.hh"
+#include "execution.hh"
+#include "stats.hh"
+
+#include <asio.hpp>
+#include <fmt/format.h>
+#include <memory>
+#include <spdlog/spdlog.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace fixme::soupstock
+{
+/// @brief A loopback HTTP endpoint exposing live counters and a few runtime
+/// commands.
+///
+/// - `GET /metrics` returns the counters in Prometheus text format.
+/// - `GET /sessions` lists the sessions, one per line.
+/// - `POST /disconnect?session=NAME` closes a session.
+/// - `POST /log-level?level=LEVEL` changes the spdlog level.
+///
+/// The endpoint runs on the same io_context as the sessions. Counters are
+/// read with relaxed loads, so scraping never takes a lock on the hot path.
+template<typename Authenticator>
+class admin
+{
+public:
+  admin(asio::io_context& context, unsigned short port, std::shared_ptr<Authenticator> authenticator)
+    : _acceptor(context, asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), port)),
+      _authenticator(std::move(authenticator))
+  {
+    asio::co_spawn(context, listen(), asio::detached);
+  }
+
+  void add_session(std::weak_ptr<base_session> session)
+  {
+    prune();
+    _sessions.push_back(entry{++_next_id, std::move(session)});
+  }
+
+  /// @brief Also export the busy poll statistics of the runner.
+  void set_runner(const runner& runner) { _runner = &runner; }
+
+private:
+  struct response
+  {
+    std::string status;
+    std::string body;
+  };
+
+  /// @brief A registered session. The id tells apart sessions with the same
+  /// name, e.g. a client session and a replication session.
+  struct entry
+  {
+    std::uint64_t id;
+    std::weak_ptr<base_session> session;
+  };
+
+  void prune()
+  {
+    std::erase_if(_sessions, [](const auto& e) { return e.session.expired(); });
+  }
+
+  asio::awaitable<void> listen()
+  {
+    while(_acceptor.is_open())
+    {
+      asio::error_code ec;
+      auto socket = co_await _acceptor.async_accept(asio::redirect_error(asio::use_awaitable, ec));
+      if(ec)
+      {
+        spdlog::info("admin: {}", ec.message());
+        continue;
+      }
+      asio::co_spawn(_acceptor.get_executor(), serve(std::move(socket)), asio::detached);
+    }
+  }
+
+  asio::awaitable<void> serve(asio::ip::tcp::socket socket)
+  {
+    try
+    {
+      std::string request;
+      co_await asio::async_read_until(socket, asio::dynamic_buffer(request, 8192), "\r\n\r\n", asio::use_awaitable);
+      auto line = std::string_view(request).substr(0, request.find("\r\n"));
+      auto method = line.substr(0, line.find(' '));
+      auto target = line.substr(method.size() + 1);
+      target = target.substr(0, target.find(' '));
+      auto result = handle(method, target);
+      auto reply = fmt::format(
+        "HTTP/1.0 {}\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: {}\r\nConnection: close\r\n\r\n{}",
+        result.status, result.body.size(), result.body);
+      co_await asio::async_write(socket, asio::buffer(reply), asio::use_awaitable);
+      asio::error_code ec;
+      socket.shutdown(asio::ip::tcp::socket::shutdown_both, ec);
+    }
+    catch(const std::exception& ex)
+    {
+      spdlog::info("admin: {}", ex.what());
+    }
+  }
+
+  static std::string_view parameter(std::string_view query, std::string_view name)
+  {
+    while(!query.empty())
+    {
+      auto pair = query.substr(0, query.find('&'));
+      if(pair.starts_with(name) && pair.size() > name.size() && pair[name.size()] == '=')
+        return pair.substr(name.size() + 1);
+      query.remove_prefix(std::min(query.size(), pair.size() + 1));
+    }
+    return {};
+  }
+
+  response handle(std::string_view method, std::string_view target)
+  {
+    auto path = target.substr(0, target.find('?'));
+    auto query = path.size() < target.size() ? target.substr(path.size() + 1) : std::string_view{};
+    if(method == "GET" && path == "/metrics")
+      return {"200 OK", metrics()};
+    if(method == "GET" && path == "/sessions")
+      return {"200 OK", sessions()};
+    if(method == "POST" && path == "/disconnect")
+      return disconnect(parameter(query, "session"));
+    if(method == "POST" && path == "/log-level")
+      return log_level(parameter(query, "level"));
+    return {"404 Not Found", "not found\n"};
+  }
+
+  /// @brief Sets the log level. `from_str` turns anything it doesn't know into
+  /// `off`, so the name is checked against the level names, and the short
+  /// names `warn` and `err` which `from_str` accepts as well.
+  response log_level(std::string_view name)
+  {
+    for(int i = 0; i < spdlog::level::n_levels; ++i)
+    {
+      auto level = static_cast<spdlog::level::level_enum>(i);
+      if(name == spdlog::level::to_string_view(level) || (name == "warn" && level == spdlog::level::warn)
+        || (name == "err" && level == spdlog::level::err))
+      {
+        spdlog::set_level(level);
+        spdlog::info("admin: log level {}", spdlog::level::to_string_view(level));
+        return {"200 OK", "ok\n"};
+      }
+    }
+    return {"400 Bad Request", fmt::format("unknown log level {}\n", name)};
+  }
+
+  response disconnect(std::string_view name)
+  {
+    prune();
+    std::size_t count{0};
+    for(const auto& e: _sessions)
+      if(auto session = e.session.lock(); session && session->name() == name)
+      {
+        spdlog::info("admin: disconnect {}", name);
+        session->disconnect();
+        ++count;
+      }
+    if(count == 0)
+      return {"404 Not Found", fmt::format("no session {}\n", name)};
+    return {"200 OK", fmt::format("disconnected {}\n", count)};
+  }
+
+  std::string sessions()
+  {
+    prune();
+    std::string body;
+    for(const auto& e: _sessions)
+      if(auto session = e.session.lock())
+      {
+        const auto& stats = session->stats();
+        fmt::format_to(std::back_inserter(body), "{} {} sequence={} queue={} in={} out={}\n", e.id,
+          session->name().empty() ? "-" : session->name(), session_stats::get(stats.sequence),
+          session_stats::get(stats.queue_depth), session_stats::get(stats.messages_in),
+          session_stats::get(stats.messages_out));
+      }
+    return body;
+  }
+
+  std::string metrics()
+  {
+    prune();
+    std::string body;
+    auto out = std::back_inserter(body);
+    auto family = [&](std::string_view name, std::string_view type, std::string_view help, auto value) {
+      fmt::format_to(out, "# HELP soupstock_{} {}\n# TYPE soupstock_{} {}\n", name, help, name, type);
+      for(const auto& e: _sessions)
+        if(auto session = e.session.lock(); session && !session->name().empty())
+          fmt::format_to(out, "soupstock_{}{{session=\"{}\",id=\"{}\"}} {}\n", name, session->name(), e.id,
+            value(session->stats()));
+    };
+    using s = session_stats;
+    family("messages_in_total", "counter", "Messages received.", [](auto& st) { return s::get(st.messages_in); });
+    family("bytes_in_total", "counter", "Bytes received.", [](auto& st) { return s::get(st.bytes_in); });
+    family("messages_out_total", "counter", "Messages sent.", [](auto& st) { return s::get(st.messages_out); });
+    family("bytes_out_total", "counter", "Bytes sent.", [](auto& st) { return s::get(st.bytes_out); });
+    family("heartbeats_in_total", "counter", "Heart beats received.",
+      [](auto& st) { return s::get(st.heartbeats_in); });
+    family("heartbeats_out_total", "counter", "Heart beats sent.", [](auto& st) { return s::get(st.heartbeats_out); });
+    family("timeouts_total", "counter", "Sessions closed by timeout.", [](auto& st) { return s::get(st.timeouts); });
+    family("duplicates_total", "counter", "Sequenced messages received again and dropped.",
+      [](auto& st) { return s::get(st.duplicates); });
+    family("gaps_total", "counter", "Sequenced messages missing after a reconnect.",
+      [](auto& st) { return s::get(st.gaps); });
+    family("queue_depth", "gauge", "Messages waiting to be sent.", [](auto& st) { return s::get(st.queue_depth); });
+    for(auto [name, lane]: {std::pair{"control", &s::control_lane}, std::pair{"data", &s::data_lane}})
+    {
+      family(fmt::format("{}_frames_total", name), "counter", fmt::format("Frames sent from the {} lane.", name),
+        [lane](auto& st) { return s::get((st.*lane).frames); });
+      family(fmt::format("{}_queue_seconds_total", name), "counter",
+        fmt::format("Time frames waited in the {} lane.", name),
+        [lane](auto& st) { return static_cast<double>(s::get((st.*lane).wait_ns)) / 1e9; });
+      family(fmt::format("{}_queue_seconds_max", name), "gauge",
+        fmt::format("Longest time a frame waited in the {} lane.", name),
+        [lane](auto& st) { return static_cast<double>(s::get((st.*lane).max_wait_ns)) / 1e9; });
+    }
+    family("sequence", "gauge", "Current sequence number.", [](auto& st) { return s::get(st.sequence); });
+    family("replay_target", "gauge", "Last sequence number of the replay.",
+      [](auto& st) { return s::get(st.replay_target); });
+    family("replay_position", "gauge", "Last sequence number replayed.",
+      [](auto& st) { return s::get(st.replay_position); });
+    family("replay_eta_seconds", "gauge", "Estimated time until the replay catches up.",
+      [](auto& st) { return static_cast<double>(s::get(st.replay_eta_ms)) / 1e3; });
+    family("replay_duration_seconds", "gauge", "Duration of the most recent completed replay.",
+      [](auto& st) { return static_cast<double>(s::get(st.replay_duration_ms)) / 1e3; });
+    family("replication_lag", "gauge", "Messages not yet sent to the standby.",
+      [](auto& st) { return s::get(st.replication_lag); });
+    family("compression_in_bytes_total", "counter", "Bytes compressed.",
+      [](auto& st) { return s::get(st.compression_in); });
+    family("compression_out_bytes_total", "counter", "Compressed bytes produced.",
+      [](auto& st) { return s::get(st.compression_out); });
+    family("compression_seconds_total", "counter", "Time spent compressing.",
+      [](auto& st) { return static_cast<double>(s::get(st.compression_ns)) / 1e9; });
+    family("database_writes_total", "counter", "Writes to the message store.",
+      [](auto& st) { return s::get(st.database_writes); });
+    family("database_write_seconds_total", "counter", "Time spent writing to the message store.",
+      [](auto& st) { return static_cast<double>(s::get(st.database_write_ns)) / 1e9; });
+    fmt::format_to(out, "# HELP soupstock_active_sessions Sessions logged in.\n");
+    fmt::format_to(out, "# TYPE soupstock_active_sessions gauge\n");
+    fmt::format_to(out, "soupstock_active_sessions {}\n", _authenticator->active_sessions());
+    if(_runner != nullptr)
+    {
+      auto st = _runner->stats();
+      fmt::format_to(out, "# TYPE soupstock_busy_poll_polls_total counter\n");
+      fmt::format_to(out, "soupstock_busy_poll_polls_total {}\n", st.polls);
+      fmt::format_to(out, "# TYPE soupstock_busy_poll_idle_spins_total counter\n");
+      fmt::format_to(out, "soupstock_busy_poll_idle_spins_total {}\n", st.idle_spins);
+      fmt::format_to(out, "# TYPE soupstock_busy_poll_gap_seconds_max gauge\n");
+      fmt::format_to(out, "soupstock_busy_poll_gap_seconds_max {}\n", static_cast<double>(st.gap_max.count()) / 1e9);
+      fmt::format_to(out, "# TYPE soupstock_wakeup_latency_seconds_total counter\n");
+      fmt::format_to(
+        out, "soupstock_wakeup_latency_seconds_total {}\n", static_cast<double>(st.wakeup_total.count()) / 1e9);
+      fmt::format_to(out, "# TYPE soupstock_wakeups_total counter\n");
+      fmt::format_to(out, "soupstock_wakeups_total {}\n", st.wakeups);
+      fmt::format_to(out, "# TYPE soupstock_wakeup_latency_seconds_max gauge\n");
+      fmt::format_to(
+        out, "soupstock_wakeup_latency_seconds_max {}\n", static_cast<double>(st.wakeup_max.count()) / 1e9);
+    }
+    return body;
+  }
+
+  asio::ip::tcp::acceptor _acceptor;
+  std::shared_ptr<Authenticator> _authenticator;
+  std::vector<entry> _sessions;
+  std::uint64_t _next_id{0};
+  const runner* _runner{nullptr};
+};
+} // namespace fixme::soupstock
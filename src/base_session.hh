@@ -16,15 +16,35 @@
 
 #pragma once
 
+#include "capture.hh"
+#include "stats.hh"
+
 #include <asio.hpp>
+#include <cerrno>
 #include <deque>
 #include <fmt/format.h>
+#include <lz4.h>
+#include <memory>
+#include <span>
 #include <spdlog/spdlog.h>
+#include <sys/sendfile.h>
+#include <system_error>
+#include <vector>
 
 using namespace std::literals;
 
 namespace fixme
 {
+/// @brief True if `T` is an `asio::awaitable`, i.e. a handler entry point
+/// returning `T` has to be `co_await`ed.
+template<typename T>
+struct is_awaitable: std::false_type
+{};
+
+template<typename T, typename Executor>
+struct is_awaitable<asio::awaitable<T, Executor>>: std::true_type
+{};
+
 /// @brief Base class for sessions.
 ///
 /// There are two virtual function which derived classes need to override.
@@ -33,6 +53,10 @@ namespace fixme
 /// - `void timer_handler()`
 ///   Called when the SoupBinTCP heart beat timer expires. The session needs to
 ///   send a heart beat message to keep the connection alive.
+///
+/// Derived classes with handlers which return `asio::awaitable` override
+/// `process_message_async` as well, and those waiting on timers of their own
+/// override `stopped` to cancel them.
 class base_session: public std::enable_shared_from_this<base_session>
 {
 public:
@@ -41,6 +65,7 @@ public:
       _strand(asio::make_strand(_socket.get_executor())),
       _timer(_strand),
       _timeout(_strand),
+      _drained(_strand),
       _session_name(std::move(session_name))
   {}
 
@@ -49,6 +74,45 @@ public:
   const std::string& name() const { return _session_name; }
   int sequence() const { return _sequence; }
 
+  /// @brief Enables pipelining of received messages.
+  ///
+  /// With pipelining the reader keeps reading while earlier messages are
+  /// still being processed. Messages are processed one at a time in the order
+  /// they were received, so ordering and sequence semantics are unchanged.
+  /// Heart beats are handled as soon as they arrive. The reader stops reading
+  /// when `max_in_flight` messages are waiting or being processed.
+  ///
+  /// Without pipelining the reader waits for each handler, including one
+  /// suspended in an `asio::awaitable`. Heart beats queue behind it, so a
+  /// handler which takes longer than the 15 second timeout ends the session.
+  ///
+  /// @param max_in_flight Zero disables pipelining, which is the default.
+  void set_pipeline(std::size_t max_in_flight) { _max_in_flight = max_in_flight; }
+
+  /// @brief Captures every framed packet, inbound and outbound, to `capture`.
+  void set_capture(std::shared_ptr<capture> capture)
+  {
+    _capture = std::move(capture);
+    if(_capture)
+      _connection = _capture->open_connection();
+  }
+
+  /// @brief Sends data in LZ4 compressed blocks. Only enabled for peers which
+  /// asked for it at login, since plain SoupBinTCP peers don't know the
+  /// compressed packet type. Received compressed blocks are always accepted.
+  void set_compression(bool compress) { _compress = compress; }
+  bool compression() const { return _compress; }
+
+  /// @brief The session's live counters.
+  const session_stats& stats() const { return _stats; }
+
+  /// @brief Closes the session from any thread.
+  void disconnect()
+  {
+    auto self = shared_from_this();
+    asio::post(_strand, [self] { self->stop(); });
+  }
+
   void run()
   {
     auto self = shared_from_this();
@@ -58,6 +122,24 @@ public:
   }
 
 protected:
+  /// @brief Framed messages in a file, e.g. a wire log of the message store.
+  struct file_range
+  {
+    std::shared_ptr<const int> file;
+    std::uint64_t offset;
+    std::size_t length;
+    std::size_t frames;
+  };
+
+  /// @brief A framed packet, or a range of them in a file, waiting to be
+  /// sent.
+  struct frame
+  {
+    std::string data;
+    std::chrono::steady_clock::time_point queued;
+    std::shared_ptr<const file_range> file{};
+  };
+
   /// @brief Reads SoupBinTCP messages from the socket associated with the
   /// session and process them.
   asio::awaitable<void> reader()
@@ -66,13 +148,18 @@ protected:
     {
       while(_socket.is_open())
       {
-        std::int16_t length;
+        std::uint16_t length;
         co_await asio::async_read(_socket, asio::buffer(&length, sizeof(length)), asio::use_awaitable);
         length = ntohs(length);
         std::string msg;
         co_await asio::async_read(_socket, asio::dynamic_buffer(msg, length), asio::use_awaitable);
         _timeout.expires_after(15s);
-        process_message(msg);
+        session_stats::add(_stats.bytes_in, sizeof(length) + msg.size());
+        if(msg.empty() || msg[0] != compressed_type)
+          co_await receive(std::move(msg));
+        else
+          for(auto& m: decompress(msg))
+            co_await receive(std::move(m));
       }
     }
     catch(const std::exception& ex)
@@ -82,22 +169,192 @@ protected:
     }
   }
 
-  /// @brief Writes queued messages. Once all messages in the queue are send
-  /// the coroutine exit.
+  /// @brief Processes one received packet.
+  asio::awaitable<void> receive(std::string msg)
+  {
+    session_stats::add(_stats.messages_in);
+    if(is_heartbeat(msg))
+      session_stats::add(_stats.heartbeats_in);
+    if(_capture)
+      _capture->record(_connection, capture::direction::in, msg);
+    if(_max_in_flight == 0 || is_heartbeat(msg))
+      co_await process_message_async(std::move(msg));
+    else
+      co_await enqueue(std::move(msg));
+    session_stats::set(_stats.sequence, _sequence);
+  }
+
+  /// @brief Splits a compressed block into the packets it holds.
+  std::vector<std::string> decompress(std::string_view block)
+  {
+    if(block.size() < compressed_header)
+      throw std::runtime_error("compressed block too short");
+    std::size_t size{0};
+    for(std::size_t i = 1; i < compressed_header; ++i)
+      size = (size << 8) | static_cast<unsigned char>(block[i]);
+    if(size > max_block)
+      throw std::runtime_error(fmt::format("compressed block too large: {}", size));
+    std::string raw(size, '\0');
+    auto n = LZ4_decompress_safe(block.data() + compressed_header, raw.data(),
+      static_cast<int>(block.size() - compressed_header), static_cast<int>(size));
+    if(n != static_cast<int>(size))
+      throw std::runtime_error("corrupt compressed block");
+    std::vector<std::string> msgs;
+    for(std::size_t pos = 0; pos < size;)
+    {
+      if(pos + 2 > size)
+        throw std::runtime_error("corrupt compressed block");
+      std::size_t length = (static_cast<unsigned char>(raw[pos]) << 8) | static_cast<unsigned char>(raw[pos + 1]);
+      if(pos + 2 + length > size)
+        throw std::runtime_error("corrupt compressed block");
+      msgs.emplace_back(raw, pos + 2, length);
+      pos += 2 + length;
+    }
+    return msgs;
+  }
+
+  /// @brief Compresses the first `count` data frames into `_block`. Returns
+  /// false if that doesn't make them smaller.
+  bool compress(std::size_t count)
+  {
+    auto start = std::chrono::steady_clock::now();
+    _raw.clear();
+    for(std::size_t i = 0; i < count; ++i)
+    {
+      const auto& data = _messages[i].data;
+      _raw.push_back(static_cast<char>(data.size() >> 8));
+      _raw.push_back(static_cast<char>(data.size()));
+      _raw.append(data);
+    }
+    auto bound = LZ4_compressBound(static_cast<int>(_raw.size()));
+    _block.resize(compressed_header + static_cast<std::size_t>(bound));
+    _block[0] = compressed_type;
+    for(std::size_t i = 1; i < compressed_header; ++i)
+      _block[i] = static_cast<char>(_raw.size() >> (8 * (compressed_header - 1 - i)));
+    auto n = LZ4_compress_default(_raw.data(), _block.data() + compressed_header, static_cast<int>(_raw.size()), bound);
+    _block.resize(compressed_header + static_cast<std::size_t>(std::max(n, 0)));
+    session_stats::add(_stats.compression_in, _raw.size());
+    session_stats::add(_stats.compression_out, _block.size());
+    session_stats::add(_stats.compression_ns,
+      static_cast<std::uint64_t>(std::chrono::nanoseconds(std::chrono::steady_clock::now() - start).count()));
+    return n > 0 && _block.size() < _raw.size();
+  }
+
+  static bool is_heartbeat(std::string_view msg) { return !msg.empty() && (msg[0] == 'H' || msg[0] == 'R'); }
+
+  /// @brief Queues a received message for the processor coroutine and waits
+  /// while the number of messages in flight is at the limit.
+  asio::awaitable<void> enqueue(std::string msg)
+  {
+    _pending.push_back(std::move(msg));
+    if(_pending.size() == 1)
+    {
+      auto self = shared_from_this();
+      asio::co_spawn(_strand, [self] { return self->processor(); }, asio::detached);
+    }
+    while(_socket.is_open() && _pending.size() >= _max_in_flight)
+    {
+      _drained.expires_at(std::chrono::steady_clock::time_point::max());
+      asio::error_code ec;
+      co_await _drained.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+    }
+  }
+
+  /// @brief Processes pipelined messages in order. A message stays in the
+  /// queue until it has been processed so that it counts as in flight.
+  asio::awaitable<void> processor()
+  {
+    try
+    {
+      while(_socket.is_open() && !_pending.empty())
+      {
+        co_await process_message_async(_pending.front());
+        _pending.pop_front();
+        _drained.cancel();
+      }
+    }
+    catch(const std::exception& ex)
+    {
+      spdlog::info("{}: exception: {}", _session_name, ex.what());
+      stop();
+    }
+  }
+
+  /// @brief Writes queued messages. Once all messages in the queues are sent
+  /// the coroutine exits.
+  ///
+  /// Every write starts with all pending control frames followed by up to
+  /// `max_batch` data frames, so a control frame never waits for more than
+  /// the write in progress. Gathering frames into a single write lets bursts
+  /// leave in as few system calls as possible.
   ///
   /// If there are exceptions while writing to the session is stopped.
   asio::awaitable<void> writer()
   {
     try
     {
-      while(_socket.is_open() && !_messages.empty())
+      std::vector<std::uint16_t> lengths;
+      std::vector<asio::const_buffer> buffers;
+      while(_socket.is_open() && (!_control.empty() || !_messages.empty()))
       {
-        auto data = _messages.front();
-        std::int16_t length = data.length();
-        length = htons(length);
-        co_await asio::async_write(_socket, asio::buffer(&length, sizeof(length)), asio::use_awaitable);
-        co_await asio::async_write(_socket, asio::buffer(data), asio::use_awaitable);
-        _messages.pop_front();
+        auto controls = _control.size();
+        std::size_t count{0};
+        std::size_t block{0};
+        while(count < std::min(_messages.size(), max_batch) && !_messages[count].file
+          && (!_compress || count == 0 || block + 2 + _messages[count].data.size() <= max_block))
+          block += 2 + _messages[count++].data.size();
+        if(controls == 0 && count == 0)
+        {
+          // A file range is next and no control frame is waiting.
+          auto& f = _messages.front();
+          session_stats::queued(_stats.data_lane, std::chrono::steady_clock::now() - f.queued);
+          auto bytes = co_await send_file(*f.file);
+          session_stats::add(_stats.messages_out, f.file->frames);
+          session_stats::add(_stats.bytes_out, bytes);
+          _messages.pop_front();
+          session_stats::set(_stats.queue_depth, static_cast<std::int64_t>(_control.size() + _messages.size()));
+          continue;
+        }
+        lengths.resize(controls + count);
+        buffers.clear();
+        std::size_t heartbeats{0};
+        auto now = std::chrono::steady_clock::now();
+        auto gather = [&](const frame& f, session_stats::lane& lane) {
+          auto& length = lengths[buffers.size() / 2];
+          length = htons(static_cast<std::uint16_t>(f.data.length()));
+          buffers.push_back(asio::buffer(&length, sizeof(length)));
+          buffers.push_back(asio::buffer(f.data));
+          heartbeats += is_heartbeat(f.data) ? 1 : 0;
+          session_stats::queued(lane, now - f.queued);
+          if(_capture)
+            _capture->record(_connection, capture::direction::out, f.data);
+        };
+        for(std::size_t i = 0; i < controls; ++i)
+          gather(_control[i], _stats.control_lane);
+        if(_compress && count > 1 && compress(count))
+        {
+          auto& length = lengths[buffers.size() / 2];
+          length = htons(static_cast<std::uint16_t>(_block.size()));
+          buffers.push_back(asio::buffer(&length, sizeof(length)));
+          buffers.push_back(asio::buffer(_block));
+          for(std::size_t i = 0; i < count; ++i)
+          {
+            session_stats::queued(_stats.data_lane, now - _messages[i].queued);
+            if(_capture)
+              _capture->record(_connection, capture::direction::out, _messages[i].data);
+          }
+        }
+        else
+          for(std::size_t i = 0; i < count; ++i)
+            gather(_messages[i], _stats.data_lane);
+        auto bytes = co_await asio::async_write(_socket, buffers, asio::use_awaitable);
+        _control.erase(_control.begin(), _control.begin() + static_cast<std::ptrdiff_t>(controls));
+        _messages.erase(_messages.begin(), _messages.begin() + static_cast<std::ptrdiff_t>(count));
+        session_stats::add(_stats.messages_out, controls + count);
+        session_stats::add(_stats.bytes_out, bytes);
+        session_stats::add(_stats.heartbeats_out, heartbeats);
+        session_stats::set(_stats.queue_depth, static_cast<std::int64_t>(_control.size() + _messages.size()));
+        session_stats::set(_stats.sequence, _sequence);
       }
       _timer.expires_after(1s);
     }
@@ -108,6 +365,30 @@ protected:
     }
   }
 
+  /// @brief Sends a range of framed messages straight from a file with
+  /// `sendfile`, so the data is never copied to user space.
+  asio::awaitable<std::size_t> send_file(const file_range& range)
+  {
+    _socket.native_non_blocking(true);
+    auto offset = static_cast<off_t>(range.offset);
+    auto remaining = range.length;
+    while(remaining > 0)
+    {
+      auto n = ::sendfile(_socket.native_handle(), *range.file, &offset, remaining);
+      if(n < 0 && (errno == EAGAIN || errno == EINTR))
+      {
+        co_await _socket.async_wait(asio::ip::tcp::socket::wait_write, asio::use_awaitable);
+        continue;
+      }
+      if(n < 0)
+        throw std::system_error(errno, std::generic_category(), "sendfile");
+      if(n == 0)
+        throw std::runtime_error("sendfile: unexpected end of file");
+      remaining -= static_cast<std::size_t>(n);
+    }
+    co_return range.length;
+  }
+
   /// @brief The heart beat timer coroutine.
   ///
   /// Sends a heart beat message every time the timer expires. When other types
@@ -149,6 +430,7 @@ protected:
         co_await _timeout.async_wait(asio::redirect_error(asio::use_awaitable, ec));
         if(ec != asio::error::operation_aborted)
         {
+          session_stats::add(_stats.timeouts);
           throw std::runtime_error("timeout");
           stop();
         }
@@ -166,38 +448,130 @@ protected:
   {
     _timer.cancel();
     _timeout.cancel();
+    _drained.cancel();
+    stopped();
     std::error_code ec;
     _socket.shutdown(asio::ip::tcp::socket::shutdown_both, ec);
     _socket.close();
   }
 
-  /// @brief Dispatch a message to the message queue.
+  /// @brief True for packet types which are sent in the control lane.
+  ///
+  /// Login responses, heart beats and debug packets overtake queued data.
+  /// Logout and end of session packets mark the end of the data and stay in
+  /// the data lane.
+  static bool is_control(char message_type)
+  {
+    switch(message_type)
+    {
+      case 'A':
+      case 'J':
+      case 'L':
+      case 'H':
+      case 'R':
+      case '+':
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  /// @brief Dispatch a message to the control or the data lane.
   ///
-  /// If this is the first message pushed on the queue the writer coroutine is
-  /// started.
+  /// If both lanes were empty the writer coroutine is started.
   void dispatch(char message_type, std::string_view data = {})
   {
-    asio::post(_strand, [this, message_type, msg = std::string(data)]() {
-      _messages.push_back(fmt::format("{}{}", message_type, msg));
-      if(_messages.size() == 1)
-      {
-        auto self = shared_from_this();
-        asio::co_spawn(_strand, [self] { return self->writer(); }, asio::detached);
-      }
+    frame f{fmt::format("{}{}", message_type, data), std::chrono::steady_clock::now()};
+    asio::post(_strand, [this, message_type, f = std::move(f)]() mutable {
+      auto idle = _control.empty() && _messages.empty();
+      (is_control(message_type) ? _control : _messages).push_back(std::move(f));
+      start_writer(idle);
+    });
+  }
+
+  /// @brief Dispatch a block of messages of the same type with a single post
+  /// to the strand.
+  void dispatch(char message_type, std::span<const std::string_view> data)
+  {
+    std::vector<frame> frames;
+    frames.reserve(data.size());
+    auto now = std::chrono::steady_clock::now();
+    for(auto msg: data)
+      frames.push_back(frame{fmt::format("{}{}", message_type, msg), now});
+    asio::post(_strand, [this, message_type, frames = std::move(frames)]() mutable {
+      auto idle = _control.empty() && _messages.empty();
+      std::ranges::move(frames, std::back_inserter(is_control(message_type) ? _control : _messages));
+      start_writer(idle);
     });
   }
 
+  /// @brief Queues framed messages stored in a file. They are sent in the
+  /// data lane in order with other data, see `send_file`.
+  void dispatch(file_range range)
+  {
+    frame f{{}, std::chrono::steady_clock::now(), std::make_shared<const file_range>(std::move(range))};
+    asio::post(_strand, [this, f = std::move(f)]() mutable {
+      auto idle = _control.empty() && _messages.empty();
+      _messages.push_back(std::move(f));
+      start_writer(idle);
+    });
+  }
+
+  /// @brief Starts the writer if frames were queued while it was idle.
+  void start_writer(bool idle)
+  {
+    session_stats::set(_stats.queue_depth, static_cast<std::int64_t>(_control.size() + _messages.size()));
+    if(idle && (!_control.empty() || !_messages.empty()))
+    {
+      auto self = shared_from_this();
+      asio::co_spawn(_strand, [self] { return self->writer(); }, asio::detached);
+    }
+  }
+
+  /// @brief The maximum number of data messages gathered into one write.
+  static constexpr std::size_t max_batch{256};
+  /// @brief The packet type of a compressed block: a four byte big endian
+  /// uncompressed size followed by the LZ4 compressed frames, each with its
+  /// length. Not part of SoupBinTCP.
+  static constexpr char compressed_type{'C'};
+  static constexpr std::size_t compressed_header{5};
+  /// @brief The most frame bytes in one compressed block, small enough that
+  /// the block always fits in a frame.
+  static constexpr std::size_t max_block{60000};
+
   asio::ip::tcp::socket _socket;
   asio::strand<asio::any_io_executor> _strand;
   asio::steady_timer _timer;
   asio::steady_timer _timeout;
+  asio::steady_timer _drained;
   std::string _session_name;
 
-  std::deque<std::string> _messages;
-  int _sequence;
+  std::deque<frame> _control;
+  std::deque<frame> _messages;
+  std::deque<std::string> _pending;
+  std::size_t _max_in_flight{0};
+  int _sequence{0};
+  session_stats _stats;
+  std::shared_ptr<capture> _capture;
+  std::uint32_t _connection{0};
+  bool _compress{false};
+  std::string _raw;
+  std::string _block;
 
 private:
   virtual void process_message(std::string_view msg) = 0;
   virtual void timer_handler() = 0;
+
+  /// @brief Processes a message, possibly suspending the reader or the
+  /// pipeline while the handler runs. The default calls `process_message`.
+  virtual asio::awaitable<void> process_message_async(std::string msg)
+  {
+    process_message(msg);
+    co_return;
+  }
+
+  /// @brief Called by `stop`, on the strand, to wake up anything derived
+  /// classes have suspended.
+  virtual void stopped() {}
 };
 } // namespace fixme
@@ -0,0 +1,586 @@
+// soupstock - a soupbintcp library
+//
+// Copyright 2025 Krister Joas
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Measures the throughput of the library's hot paths over loopback.
+//
+//   bench NAME [--count N] [--size BYTES] [--batch N] [--batches N,...]
+//              [--delay MICROSECONDS] [--pipeline N] [--workers N] [--producers N]
+//
+// NAME is one of:
+// - batch: sequenced messages sent in blocks of each of `--batches`, 1, 16
+//   and 256 by default, where 1 is one `send_sequenced` per message
+// - pipeline: unsequenced messages to an awaitable handler which waits
+//   `--delay` each, without and with pipelining of up to `--pipeline`
+// - replay: a stored session replayed from the message table and, with
+//   sendfile, from the wire log, also reporting the CPU time of the thread
+//   running the session. The defaults store about 1 MB, which fits in every
+//   cache; a replay representative of a day's session is several GB, e.g.
+//   `--count 20000000 --size 200`.
+// - workers: sequenced messages received by a client whose handler spends
+//   `--delay` preparing each, on the strand and with 1 to `--workers` workers
+// - compress: sequenced messages sent in blocks of `--batch`, without and
+//   with LZ4 compression, also reporting the bytes on the wire and the time
+//   spent compressing per message
+// - publish: sequenced messages published from 1 to `--producers` threads
+//   outside the session's strand
+//
+// Every benchmark runs its variants one after the other and prints one line
+// per variant. Message stores are created in a scratch directory which is
+// removed afterwards.
+
+#include "client_session.hh"
+#include "execution.hh"
+#include "server_handler.hh"
+#include "server_session.hh"
+
+#include <asio.hpp>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fmt/format.h>
+#include <lz4.h>
+#include <ranges>
+#include <span>
+#include <spdlog/spdlog.h>
+#include <string>
+#include <sys/resource.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace fixme::soupstock
+{
+using clock = std::chrono::steady_clock;
+
+struct bench_config
+{
+  /// @brief Messages per variant.
+  std::size_t count{10000};
+  /// @brief Payload bytes per message.
+  std::size_t size{100};
+  /// @brief Messages per block in the batched variants.
+  std::size_t batch{256};
+  /// @brief The block sizes compared by the batch benchmark.
+  std::vector<std::size_t> batches{1, 16, 256};
+  /// @brief The time an awaitable handler is suspended per message.
+  std::chrono::microseconds delay{50};
+  /// @brief Messages in flight in the pipelined variants.
+  std::size_t pipeline{64};
+  /// @brief The most worker threads in the worker variants.
+  std::size_t workers{8};
+  /// @brief The most producer threads in the publish variants.
+  std::size_t producers{16};
+};
+
+/// @brief Accepts every login.
+class bench_authenticator
+{
+public:
+  bool authenticate(std::string_view, std::string_view, std::string_view) { return true; }
+  bool authenticate_replica(std::string_view, std::string_view, std::string_view) { return false; }
+  bool feed(std::string_view) { return false; }
+};
+
+using bench_session = server_session<server_handler, bench_authenticator>;
+
+/// @brief Counts what a `slow_handler` has processed and stops the
+/// io_context once it is done. Doubles as the authenticator since that is
+/// what the session passes to its handler.
+class slow_work: public bench_authenticator
+{
+public:
+  slow_work(asio::io_context& context, std::chrono::microseconds delay, std::size_t expected)
+    : _context(context),
+      _delay(delay),
+      _expected(expected)
+  {}
+
+  std::chrono::microseconds delay() const { return _delay; }
+  std::size_t processed() const { return _processed; }
+
+  void done()
+  {
+    if(++_processed == _expected)
+      _context.stop();
+  }
+
+private:
+  asio::io_context& _context;
+  std::chrono::microseconds _delay;
+  std::size_t _expected;
+  std::size_t _processed{0};
+};
+
+/// @brief A server handler whose `process_unsequenced` is suspended for a
+/// while, like one waiting for a reply from another service.
+template<typename Authenticator>
+class slow_handler: public server_handler<Authenticator>
+{
+public:
+  slow_handler(std::shared_ptr<Authenticator> work)
+    : server_handler<Authenticator>(work),
+      _work(std::move(work))
+  {}
+
+  template<typename Session>
+  asio::awaitable<void> process_unsequenced(Session&, const std::string_view)
+  {
+    asio::steady_timer timer(co_await asio::this_coro::executor, _work->delay());
+    co_await timer.async_wait(asio::use_awaitable);
+    _work->done();
+  }
+
+private:
+  std::shared_ptr<Authenticator> _work;
+};
+
+/// @brief The receiving end of a session under test. Counts sequenced
+/// messages, including those in compressed blocks, and stops the io_context
+/// once `expected` have arrived.
+class sink
+{
+public:
+  sink(asio::ip::tcp::socket socket, std::size_t expected)
+    : _socket(std::move(socket)),
+      _expected(expected)
+  {
+    asio::co_spawn(_socket.get_executor(), read(), asio::detached);
+  }
+
+  std::size_t received() const { return _received; }
+  std::size_t bytes() const { return _bytes; }
+
+private:
+  asio::awaitable<void> read()
+  {
+    try
+    {
+      std::string buffer;
+      std::string raw;
+      while(_received < _expected)
+      {
+        auto size = buffer.size();
+        buffer.resize(size + 65536);
+        auto n = co_await _socket.async_read_some(asio::buffer(buffer.data() + size, 65536), asio::use_awaitable);
+        buffer.resize(size + n);
+        _bytes += n;
+        std::size_t pos{0};
+        while(buffer.size() - pos >= 2)
+        {
+          auto length = frame_length(buffer.data() + pos);
+          if(buffer.size() - pos - 2 < length)
+            break;
+          std::string_view frame(buffer.data() + pos + 2, length);
+          if(frame.starts_with('S'))
+            ++_received;
+          else if(frame.starts_with('C'))
+            _received += count_block(frame, raw);
+          pos += 2 + length;
+        }
+        buffer.erase(0, pos);
+      }
+    }
+    catch(const std::exception& ex)
+    {
+      spdlog::warn("sink: {}", ex.what());
+    }
+    static_cast<asio::io_context&>(_socket.get_executor().context()).stop();
+  }
+
+  static std::size_t frame_length(const char* header)
+  {
+    return (static_cast<unsigned char>(header[0]) << 8) | static_cast<unsigned char>(header[1]);
+  }
+
+  /// @brief Counts the sequenced messages in a compressed block.
+  static std::size_t count_block(std::string_view block, std::string& raw)
+  {
+    std::size_t size{0};
+    for(std::size_t i = 1; i < 5; ++i)
+      size = (size << 8) | static_cast<unsigned char>(block[i]);
+    raw.resize(size);
+    LZ4_decompress_safe(block.data() + 5, raw.data(), static_cast<int>(block.size() - 5), static_cast<int>(size));
+    std::size_t count{0};
+    for(std::size_t pos = 0; pos + 2 <= size;)
+    {
+      auto length = frame_length(raw.data() + pos);
+      count += length > 0 && raw[pos + 2] == 'S' ? 1 : 0;
+      pos += 2 + length;
+    }
+    return count;
+  }
+
+  asio::ip::tcp::socket _socket;
+  std::size_t _expected;
+  std::size_t _received{0};
+  std::size_t _bytes{0};
+};
+
+/// @brief Connects a logged in server session to a socket over loopback.
+std::pair<std::shared_ptr<bench_session>, asio::ip::tcp::socket> connect(
+  asio::io_context& context, std::string_view name, segment_policy policy = {})
+{
+  asio::ip::tcp::acceptor acceptor(context, asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+  asio::ip::tcp::socket peer(context);
+  peer.connect(acceptor.local_endpoint());
+  auto session = std::make_shared<bench_session>(
+    acceptor.accept(), std::make_shared<bench_authenticator>(), nullptr, std::move(policy));
+  session->accept_login(name, 1);
+  return {std::move(session), std::move(peer)};
+}
+
+void report(std::string_view variant, std::size_t count, clock::duration elapsed, std::size_t bytes = 0,
+  std::string_view note = {})
+{
+  auto seconds = std::chrono::duration<double>(elapsed).count();
+  fmt::print("{:<32} {:>9} messages {:>8.3f} s {:>12.0f} msg/s", variant, count, seconds,
+    seconds > 0 ? static_cast<double>(count) / seconds : 0.0);
+  if(bytes > 0)
+    fmt::print(" {:>10} bytes", bytes);
+  if(!note.empty())
+    fmt::print(" {}", note);
+  fmt::print("\n");
+}
+
+/// @brief The user and system CPU time used by the calling thread.
+std::pair<std::chrono::microseconds, std::chrono::microseconds> thread_cpu_time()
+{
+  rusage usage{};
+  if(::getrusage(RUSAGE_THREAD, &usage) != 0)
+    throw std::runtime_error(fmt::format("getrusage: {}", std::strerror(errno)));
+  auto micros = [](const timeval& tv) {
+    return std::chrono::seconds(tv.tv_sec) + std::chrono::microseconds(tv.tv_usec);
+  };
+  return {micros(usage.ru_utime), micros(usage.ru_stime)};
+}
+
+/// @brief `send_sequenced` one message at a time against blocks of each of
+/// `config.batches` messages, from storing to the last byte received.
+void bench_batch(const bench_config& config)
+{
+  std::string payload(config.size, 'x');
+  for(auto batch: config.batches)
+  {
+    asio::io_context context{1};
+    auto [session, peer] = connect(context, fmt::format("batch{}", batch));
+    sink counter(std::move(peer), config.count);
+    auto start = clock::now();
+    if(batch == 1)
+      for(std::size_t i = 0; i < config.count; ++i)
+        session->send_sequenced(payload);
+    else
+    {
+      std::vector<std::string_view> block(batch, payload);
+      for(std::size_t sent = 0; sent < config.count; sent += batch)
+        session->send_sequenced(std::span(block).first(std::min(batch, config.count - sent)));
+    }
+    context.run();
+    report(fmt::format("batch {}", batch), counter.received(), clock::now() - start);
+  }
+}
+
+void append_frame(std::string& stream, char type, std::string_view payload)
+{
+  stream.push_back(static_cast<char>((payload.size() + 1) >> 8));
+  stream.push_back(static_cast<char>(payload.size() + 1));
+  stream.push_back(type);
+  stream.append(payload);
+}
+
+/// @brief Frames `count` unsequenced messages after a login request.
+std::string unsequenced_stream(std::size_t count, std::size_t size)
+{
+  std::string stream;
+  append_frame(stream, 'L', fmt::format("{:<6s}{:<10s}{:<10s}{:<20d}", "bench", "bench", "pipeline", 1));
+  std::string payload(size, 'x');
+  for(std::size_t i = 0; i < count; ++i)
+    append_frame(stream, 'U', payload);
+  return stream;
+}
+
+/// @brief An awaitable handler suspended for `config.delay` per message,
+/// without pipelining and with up to `config.pipeline` messages in flight.
+void bench_pipeline(const bench_config& config)
+{
+  auto stream = unsequenced_stream(config.count, config.size);
+  for(auto max_in_flight: {std::size_t{0}, config.pipeline})
+  {
+    asio::io_context context{1};
+    auto work = std::make_shared<slow_work>(context, config.delay, config.count);
+    asio::ip::tcp::acceptor acceptor(context, asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+    asio::ip::tcp::socket peer(context);
+    peer.connect(acceptor.local_endpoint());
+    auto session = std::make_shared<server_session<slow_handler, slow_work>>(acceptor.accept(), work, nullptr);
+    session->set_pipeline(max_in_flight);
+    session->run();
+    auto start = clock::now();
+    asio::async_write(peer, asio::buffer(stream), asio::detached);
+    context.run();
+    report(max_in_flight == 0 ? "synchronous" : fmt::format("pipelined {}", max_in_flight), work->processed(),
+      clock::now() - start);
+  }
+}
+
+/// @brief Sends `config.count` order-like messages in blocks of
+/// `config.batch`, without and with compression, from storing to the last
+/// byte received, and the time spent compressing per message.
+void bench_compress(const bench_config& config)
+{
+  std::vector<std::string> payloads;
+  for(std::size_t i = 0; i < config.batch; ++i)
+  {
+    auto msg = fmt::format("{:010d}B{:<8}{:>10}{:>12}", i, i % 3 == 0 ? "AAPL" : i % 3 == 1 ? "MSFT" : "NVDA",
+      100 * (i % 7 + 1), 18725 + i % 50);
+    msg.resize(std::max(msg.size(), config.size), ' ');
+    payloads.push_back(std::move(msg));
+  }
+  std::vector<std::string_view> block(payloads.begin(), payloads.end());
+  for(auto compress: {false, true})
+  {
+    asio::io_context context{1};
+    auto [session, peer] = connect(context, compress ? "compress" : "plain");
+    session->set_compression(compress);
+    sink counter(std::move(peer), config.count);
+    auto start = clock::now();
+    for(std::size_t sent = 0; sent < config.count; sent += config.batch)
+      session->send_sequenced(std::span(block).first(std::min(config.batch, config.count - sent)));
+    context.run();
+    auto elapsed = clock::now() - start;
+    auto compression_ns = static_cast<double>(session_stats::get(session->stats().compression_ns));
+    auto messages = static_cast<double>(std::max<std::size_t>(1, counter.received()));
+    report(compress ? "lz4" : "uncompressed", counter.received(), elapsed, counter.bytes(),
+      fmt::format("{:>8.1f} ns/msg compressing", compression_ns / messages));
+  }
+}
+
+/// @brief `config.count` messages published to one session from a doubling
+/// number of threads up to `config.producers`, from the first publish to the
+/// last byte received.
+void bench_publish(const bench_config& config)
+{
+  std::string payload(config.size, 'x');
+  for(std::size_t producers = 1; producers <= config.producers; producers *= 2)
+  {
+    asio::io_context context{1};
+    auto [session, peer] = connect(context, fmt::format("publish{}", producers));
+    sink counter(std::move(peer), config.count);
+    auto start = clock::now();
+    std::vector<std::thread> threads;
+    for(std::size_t p = 0; p < producers; ++p)
+      threads.emplace_back(
+        [&, p]
+        {
+          for(auto i = p; i < config.count; i += producers)
+            session->publish(payload);
+        });
+    context.run();
+    auto elapsed = clock::now() - start;
+    for(auto& t: threads)
+      t.join();
+    report(fmt::format("producers {}", producers), counter.received(), elapsed);
+  }
+}
+
+/// @brief A client handler whose `prepare` keeps a thread busy for a while,
+/// like decoding would. The session constructs its handler, so the settings
+/// are static.
+class decoding_handler
+{
+public:
+  static inline std::chrono::microseconds delay{};
+  static inline std::size_t expected{0};
+  static inline asio::io_context* context{nullptr};
+
+  std::size_t prepare(std::string_view msg) const
+  {
+    auto until = clock::now() + delay;
+    while(clock::now() < until)
+      ;
+    return msg.size();
+  }
+
+  template<typename Session>
+  void commit(Session&, std::string_view, std::size_t)
+  {
+    if(++_committed == expected)
+      context->stop();
+  }
+
+  template<typename Session>
+  void process_sequenced(Session& session, std::string_view msg)
+  {
+    commit(session, msg, prepare(msg));
+  }
+
+private:
+  std::size_t _committed{0};
+};
+
+/// @brief A client receiving `config.count` messages whose handler spends
+/// `config.delay` preparing each one, on the strand and with a doubling number
+/// of workers up to `config.workers`.
+void bench_workers(const bench_config& config)
+{
+  std::string stream;
+  append_frame(stream, 'A', fmt::format("{:>10}{:>20}", "workers", 1));
+  std::string payload(config.size, 'x');
+  for(std::size_t i = 0; i < config.count; ++i)
+    append_frame(stream, 'S', payload);
+  decoding_handler::delay = config.delay;
+  decoding_handler::expected = config.count;
+  for(std::size_t workers = 0; workers <= config.workers; workers = std::max<std::size_t>(1, workers * 2))
+  {
+    asio::io_context context{1};
+    decoding_handler::context = &context;
+    asio::ip::tcp::acceptor acceptor(context, asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+    session_config session{"127.0.0.1", std::to_string(acceptor.local_endpoint().port()), "bench", "bench",
+      fmt::format("workers{}", workers)};
+    session.workers = workers;
+    auto client = std::make_shared<client_session<decoding_handler>>(context, session);
+    client->run();
+    client->send_login();
+    auto peer = acceptor.accept();
+    auto start = clock::now();
+    asio::async_write(peer, asio::buffer(stream), asio::detached);
+    context.run();
+    report(workers == 0 ? "strand" : fmt::format("workers {}", workers), config.count, clock::now() - start);
+  }
+}
+
+/// @brief Replays `config.count` stored messages from the message table and
+/// from the wire log, from the login to the last byte received, and the CPU
+/// time the session's thread spends on it.
+void bench_replay(const bench_config& config)
+{
+  std::string payload(config.size, 'x');
+  std::vector<std::string_view> block(config.batch, payload);
+  for(auto wire_log: {false, true})
+  {
+    auto name = wire_log ? "replaywire"s : "replaytab"s;
+    segment_policy policy{.wire_log = wire_log};
+    {
+      database store;
+      store.open(fmt::format("server-{}.db", name), policy);
+      for(std::size_t stored = 0; stored < config.count; stored += config.batch)
+        store.store_output(std::span(block).first(std::min(config.batch, config.count - stored)));
+    }
+    asio::io_context context{1};
+    auto [session, peer] = connect(context, name, policy);
+    // The sink runs on a thread of its own so that the CPU time of this one
+    // is the session's alone.
+    asio::io_context receiver{1};
+    sink counter(asio::ip::tcp::socket(receiver, asio::ip::tcp::v4(), peer.release()), config.count);
+    std::thread reader([&] {
+      receiver.run();
+      context.stop();
+    });
+    auto [user, system] = thread_cpu_time();
+    auto start = clock::now();
+    session->replay_sequenced(1);
+    context.run();
+    auto elapsed = clock::now() - start;
+    auto [user_end, system_end] = thread_cpu_time();
+    reader.join();
+    report(wire_log ? "replay wire log" : "replay table", counter.received(), elapsed, 0,
+      fmt::format("user {:.3f} s system {:.3f} s", std::chrono::duration<double>(user_end - user).count(),
+        std::chrono::duration<double>(system_end - system).count()));
+  }
+}
+} // namespace fixme::soupstock
+
+int main(int argc, char* argv[])
+{
+  if(argc < 2)
+  {
+    fmt::print(stderr,
+      "usage: {} batch|pipeline|replay|workers|compress|publish [--count N] [--size BYTES] [--batch N]\n"
+      "       [--batches N,...] [--delay MICROSECONDS] [--pipeline N] [--workers N] [--producers N]\n",
+      argv[0]);
+    return 1;
+  }
+  try
+  {
+    std::string_view name(argv[1]);
+    fixme::soupstock::bench_config config;
+    spdlog::set_level(spdlog::level::warn);
+    for(int i = 2; i < argc; ++i)
+    {
+      std::string_view arg(argv[i]);
+      if(arg == "--count" && i + 1 < argc)
+        config.count = fixme::soupstock::parse_number<std::size_t>(arg, argv[++i]);
+      else if(arg == "--size" && i + 1 < argc)
+        config.size = fixme::soupstock::parse_number<std::size_t>(arg, argv[++i]);
+      else if(arg == "--batch" && i + 1 < argc)
+        config.batch = fixme::soupstock::parse_number<std::size_t>(arg, argv[++i]);
+      else if(arg == "--batches" && i + 1 < argc)
+      {
+        config.batches.clear();
+        for(auto batch: std::string_view(argv[++i]) | std::views::split(','))
+        {
+          config.batches.push_back(fixme::soupstock::parse_number<std::size_t>(arg, std::string_view(batch)));
+          if(config.batches.back() == 0)
+            throw std::runtime_error(fmt::format("{}: a block holds at least one message", arg));
+        }
+      }
+      else if(arg == "--delay" && i + 1 < argc)
+        config.delay = std::chrono::microseconds(fixme::soupstock::parse_number<std::int64_t>(arg, argv[++i]));
+      else if(arg == "--pipeline" && i + 1 < argc)
+        config.pipeline = fixme::soupstock::parse_number<std::size_t>(arg, argv[++i]);
+      else if(arg == "--workers" && i + 1 < argc)
+        config.workers = fixme::soupstock::parse_number<std::size_t>(arg, argv[++i]);
+      else if(arg == "--producers" && i + 1 < argc)
+        config.producers = fixme::soupstock::parse_number<std::size_t>(arg, argv[++i]);
+      else
+        spdlog::warn("unknown argument: {}", arg);
+    }
+    auto scratch = std::filesystem::temp_directory_path() / fmt::format("soupstock-bench-{}", ::getpid());
+    std::filesystem::create_directories(scratch);
+    auto cwd = std::filesystem::current_path();
+    std::filesystem::current_path(scratch);
+    try
+    {
+      if(name == "batch")
+        fixme::soupstock::bench_batch(config);
+      else if(name == "pipeline")
+        fixme::soupstock::bench_pipeline(config);
+      else if(name == "replay")
+        fixme::soupstock::bench_replay(config);
+      else if(name == "workers")
+        fixme::soupstock::bench_workers(config);
+      else if(name == "compress")
+        fixme::soupstock::bench_compress(config);
+      else if(name == "publish")
+        fixme::soupstock::bench_publish(config);
+      else
+        throw std::runtime_error(fmt::format("unknown benchmark: {}", name));
+    }
+    catch(...)
+    {
+      std::filesystem::current_path(cwd);
+      std::filesystem::remove_all(scratch);
+      throw;
+    }
+    std::filesystem::current_path(cwd);
+    std::filesystem::remove_all(scratch);
+  }
+  catch(const std::exception& ex)
+  {
+    spdlog::error("bench: {}", ex.what());
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,199 @@
+// soupstock - a soupbintcp library
+//
+// Copyright 2025 Krister Joas
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include "mpsc_queue.hh"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <fmt/format.h>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+
+using namespace std::literals;
+
+namespace fixme
+{
+/// @brief Captures framed packets of one or more connections to a file.
+///
+/// The file starts with the eight byte magic `SOUPCAP1` followed by records:
+/// - timestamp, nanoseconds since the epoch, 8 bytes
+/// - connection number, 4 bytes
+/// - direction, 'I' for inbound or 'O' for outbound, 1 byte
+/// - payload length, 2 bytes
+/// - payload, the packet type and data without the SoupBinTCP length
+/// All integers are little endian.
+///
+/// Sessions push records onto a lock free queue. A background thread takes
+/// them off the queue and writes them to the file, so recording a frame never
+/// waits for another session or for the disk.
+class capture
+{
+public:
+  enum class direction : char
+  {
+    in = 'I',
+    out = 'O'
+  };
+
+  static constexpr std::string_view magic{"SOUPCAP1"};
+  static constexpr std::size_t header_length{8 + 4 + 1 + 2};
+
+  explicit capture(const std::filesystem::path& filename)
+    : _file(filename, std::ios::binary | std::ios::trunc)
+  {
+    if(!_file)
+      throw std::runtime_error(fmt::format("capture: cannot open {}", filename.string()));
+    _file.write(magic.data(), static_cast<std::streamsize>(magic.size()));
+    _thread = std::thread([this] { flush_loop(); });
+  }
+
+  capture(const capture&) = delete;
+  capture& operator=(const capture&) = delete;
+
+  ~capture()
+  {
+    {
+      std::lock_guard lock(_mutex);
+      _stop = true;
+    }
+    _wakeup.notify_one();
+    _thread.join();
+  }
+
+  /// @brief Returns a new connection number.
+  std::uint32_t open_connection() { return _connections.fetch_add(1, std::memory_order_relaxed) + 1; }
+
+  void record(std::uint32_t connection, direction dir, std::string_view frame)
+  {
+    auto now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::system_clock::now().time_since_epoch());
+    char header[header_length];
+    put(header, static_cast<std::uint64_t>(now.count()), 8);
+    put(header + 8, connection, 4);
+    header[12] = static_cast<char>(dir);
+    put(header + 13, frame.size(), 2);
+    std::string r;
+    r.reserve(header_length + frame.size());
+    r.append(header, header_length);
+    r.append(frame);
+    auto size = r.size();
+    _records.push(std::move(r));
+    // Only the record which crosses the threshold wakes the writer. A wake-up
+    // lost to the unlocked notify delays the write by at most one interval.
+    auto queued = _queued.fetch_add(size, std::memory_order_relaxed);
+    if(queued < flush_size && queued + size >= flush_size)
+      _wakeup.notify_one();
+  }
+
+  static void put(char* out, std::uint64_t value, std::size_t bytes)
+  {
+    for(std::size_t i = 0; i < bytes; ++i)
+      out[i] = static_cast<char>(value >> (8 * i));
+  }
+
+  static std::uint64_t get(const char* in, std::size_t bytes)
+  {
+    std::uint64_t value{};
+    for(std::size_t i = 0; i < bytes; ++i)
+      value |= static_cast<std::uint64_t>(static_cast<unsigned char>(in[i])) << (8 * i);
+    return value;
+  }
+
+private:
+  void flush_loop()
+  {
+    std::string buffer;
+    while(true)
+    {
+      bool stop{false};
+      {
+        std::unique_lock lock(_mutex);
+        _wakeup.wait_for(
+          lock, 10ms, [this] { return _stop || _queued.load(std::memory_order_relaxed) >= flush_size; });
+        stop = _stop;
+      }
+      while(auto r = _records.pop())
+      {
+        _queued.fetch_sub(r->size(), std::memory_order_relaxed);
+        buffer.append(*r);
+      }
+      _file.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+      _file.flush();
+      buffer.clear();
+      if(stop)
+        return;
+    }
+  }
+
+  static constexpr std::size_t flush_size{64 * 1024};
+
+  std::ofstream _file;
+  /// @brief Only guards `_stop` and the wake-ups of the writer thread.
+  std::mutex _mutex;
+  std::condition_variable _wakeup;
+  mpsc_queue<std::string> _records;
+  std::atomic<std::size_t> _queued{0};
+  bool _stop{false};
+  std::atomic<std::uint32_t> _connections{0};
+  std::thread _thread;
+};
+
+/// @brief Reads the records of a capture file.
+class capture_reader
+{
+public:
+  struct record
+  {
+    std::chrono::nanoseconds timestamp;
+    std::uint32_t connection;
+    capture::direction direction;
+    std::string frame;
+  };
+
+  explicit capture_reader(const std::filesystem::path& filename)
+    : _file(filename, std::ios::binary)
+  {
+    std::string magic(capture::magic.size(), '\0');
+    _file.read(magic.data(), static_cast<std::streamsize>(magic.size()));
+    if(!_file || magic != capture::magic)
+      throw std::runtime_error(fmt::format("capture: {} is not a capture file", filename.string()));
+  }
+
+  std::optional<record> next()
+  {
+    char header[capture::header_length];
+    if(!_file.read(header, capture::header_length))
+      return std::nullopt;
+    record r{std::chrono::nanoseconds(capture::get(header, 8)), static_cast<std::uint32_t>(capture::get(header + 8, 4)),
+      static_cast<capture::direction>(header[12]), std::string(capture::get(header + 13, 2), '\0')};
+    if(!_file.read(r.frame.data(), static_cast<std::streamsize>(r.frame.size())))
+      return std::nullopt;
+    return r;
+  }
+
+private:
+  std::ifstream _file;
+};
+} // namespace fixme
@@ -16,6 +16,8 @@
 
 #include "client_handler.hh"
 #include "client_session.hh"
+#include "execution.hh"
+#include "mold_receiver.hh"
 #include "util.hh"
 
 namespace
@@ -69,25 +71,92 @@ asio::awaitable<int> read_from_stream(asio::posix::stream_descriptor& stream, Se
 }
 } // namespace
 
-int main()
+int main(int argc, char* argv[])
 {
   int result{};
   try
   {
-    asio::io_context context;
+    fixme::soupstock::execution_config execution;
     fixme::soupstock::session_config config{"127.0.0.1", "25000", "user1", "password1", "session1"};
+    auto args = fixme::soupstock::parse_execution_options(argc, argv, execution, config.options);
+    std::optional<fixme::soupstock::feed_config> feed;
+    std::optional<std::pair<std::string, std::string>> recovery;
+    std::optional<std::size_t> max_pending;
+    for(std::size_t i = 0; i < args.size(); ++i)
+    {
+      if(args[i] == "--server" && i + 1 < args.size())
+      {
+        auto address = args[++i];
+        auto colon = address.rfind(':');
+        if(colon == std::string_view::npos)
+          throw std::runtime_error(fmt::format("--server: expected host:port: {}", address));
+        config.host = address.substr(0, colon);
+        config.port = address.substr(colon + 1);
+      }
+      else if(args[i] == "--session" && i + 1 < args.size())
+        config.session = args[++i];
+      else if(args[i] == "--feed" && i + 1 < args.size())
+      {
+        // Receive the MoldUDP64 feed on address:port, recovering gaps from
+        // the server.
+        auto address = args[++i];
+        auto colon = address.rfind(':');
+        if(colon == std::string_view::npos)
+          throw std::runtime_error(fmt::format("--feed: expected address:port: {}", address));
+        feed = fixme::soupstock::feed_config{std::string(address.substr(0, colon)),
+          fixme::soupstock::parse_number<unsigned short>("--feed", address.substr(colon + 1))};
+      }
+      else if(args[i] == "--recovery" && i + 1 < args.size())
+      {
+        // Recover feed gaps from host:port instead of the server.
+        auto address = args[++i];
+        auto colon = address.rfind(':');
+        if(colon == std::string_view::npos)
+          throw std::runtime_error(fmt::format("--recovery: expected host:port: {}", address));
+        recovery.emplace(address.substr(0, colon), address.substr(colon + 1));
+      }
+      else if(args[i] == "--max-pending" && i + 1 < args.size())
+        max_pending = fixme::soupstock::parse_number<std::size_t>(args, i);
+      else if(args[i] == "--pipeline" && i + 1 < args.size())
+        config.max_in_flight = fixme::soupstock::parse_number<std::size_t>(args, i);
+      else if(args[i] == "--compress")
+        config.compress = true;
+      else if(args[i] == "--workers" && i + 1 < args.size())
+        config.workers = fixme::soupstock::parse_number<std::size_t>(args, i);
+      else if(args[i] == "--capture" && i + 1 < args.size())
+        config.capture_file = args[++i];
+      else
+        spdlog::warn("unknown argument: {}", args[i]);
+    }
+    asio::io_context context{1};
     auto client{std::make_shared<fixme::soupstock::client_session<fixme::soupstock::client_handler>>(context, config)};
     client->run();
     client->send_login();
+    std::shared_ptr<fixme::soupstock::mold_receiver<fixme::soupstock::client_handler>> receiver;
+    if(feed)
+    {
+      feed->recovery = config;
+      feed->recovery.session = "feed";
+      if(recovery)
+        std::tie(feed->recovery.host, feed->recovery.port) = *recovery;
+      if(max_pending)
+        feed->max_pending = *max_pending;
+      receiver = std::make_shared<fixme::soupstock::mold_receiver<fixme::soupstock::client_handler>>(context, *feed);
+      receiver->run();
+    }
     asio::posix::stream_descriptor stdin{context, STDIN_FILENO};
     asio::co_spawn(
       context,
       [&] -> asio::awaitable<void> {
         result = co_await read_from_stream(stdin, *client);
+        // The feed is only received for as long as the session is in use.
+        if(receiver)
+          receiver->close();
         co_return;
       },
       asio::detached);
-    context.run();
+    fixme::soupstock::runner runner(context, execution);
+    runner.run();
   }
   catch(const std::exception& ex)
   {
@@ -17,6 +17,7 @@
 #pragma once
 
 #include <spdlog/spdlog.h>
+#include <string>
 #include <string_view>
 
 namespace fixme::soupstock
@@ -29,5 +30,15 @@ public:
   {
     spdlog::info("{}: sequenced ({}) {}", session.name(), session.sequence(), msg);
   }
+
+  /// @brief Runs on a worker thread when the session has workers, see
+  /// `parallel_handler`.
+  std::string prepare(std::string_view msg) const { return std::string(msg); }
+
+  template<typename Session>
+  void commit(Session& session, std::string_view, std::string prepared)
+  {
+    spdlog::info("{}: sequenced ({}) {}", session.name(), session.sequence(), prepared);
+  }
 };
 } // namespace fixme::soupstock
@@ -18,15 +18,22 @@
 
 #include "base_session.hh"
 #include "database.hh"
+#include "execution.hh"
 #include "util.hh"
 
 #include <asio.hpp>
+#include <charconv>
 #include <chrono>
 #include <deque>
 #include <fmt/format.h>
 #include <fmt/ranges.h>
+#include <map>
+#include <optional>
 #include <regex>
 #include <spdlog/spdlog.h>
+#include <utility>
+#include <variant>
+#include <vector>
 
 using namespace std::literals;
 
@@ -39,6 +46,40 @@ struct session_config
   std::string username;
   std::string password;
   std::string session;
+  socket_options options;
+  /// @brief The maximum number of received messages in flight. Zero disables
+  /// pipelining, see `base_session::set_pipeline`.
+  std::size_t max_in_flight{0};
+  /// @brief Capture the session's traffic to this file, see `fixme::capture`.
+  std::string capture_file;
+  /// @brief Worker threads preparing sequenced messages in parallel. Zero
+  /// processes every message on the session's strand. Only used with a
+  /// `parallel_handler`.
+  std::size_t workers{0};
+  /// @brief Ask the server to send data in compressed blocks. Servers which
+  /// don't support it ignore the request.
+  bool compress{false};
+};
+
+/// @brief A handler which splits processing of a sequenced message in two.
+///
+/// `prepare` does the expensive part, e.g. decoding, and runs on any of the
+/// session's worker threads, so it must be safe to call concurrently.
+/// `commit(session, msg, prepared)` runs on the session's strand in sequence
+/// order with the result of `prepare`.
+template<typename Handler>
+concept parallel_handler = requires(const Handler& handler, std::string_view msg) { handler.prepare(msg); };
+
+template<typename Handler>
+struct prepared_type
+{
+  using type = std::monostate;
+};
+
+template<parallel_handler Handler>
+struct prepared_type<Handler>
+{
+  using type = decltype(std::declval<const Handler&>().prepare(std::string_view{}));
 };
 
 template<typename Handler>
@@ -52,15 +93,20 @@ public:
       _port(config.port),
       _username(config.username),
       _password(config.password),
-      _resolver(context)
-  {}
-
-  void run()
+      _options(config.options),
+      _compress_requested(config.compress),
+      _resolver(context),
+      _committed(_strand)
   {
-    auto self = std::static_pointer_cast<client_session>(shared_from_this());
-    asio::co_spawn(_socket.get_executor(), [self] { return self->reader(); }, asio::detached);
-    asio::co_spawn(_socket.get_executor(), [self] { return self->timer(); }, asio::detached);
-    asio::co_spawn(_socket.get_executor(), [self] { return self->timeout(); }, asio::detached);
+    set_pipeline(config.max_in_flight);
+    if(!config.capture_file.empty())
+      set_capture(std::make_shared<capture>(config.capture_file));
+    if constexpr(parallel_handler<Handler>)
+      if(config.workers > 0)
+      {
+        _pool = std::make_unique<asio::thread_pool>(config.workers);
+        _max_prepared = std::max(config.max_in_flight, config.workers * prepared_per_worker);
+      }
   }
 
   void close() { stop(); }
@@ -70,9 +116,13 @@ public:
     _database.open(fmt::format("client-{}-{}.db", _username, _session_name));
     load_messages();
     ++_sequence;
-    auto msg = fmt::format("{:<6s}{:<10s}{:<10s}{:<20d}", _username, _password, _session_name, _sequence);
+    _next_assigned = _sequence;
+    // The compression request is an extra byte after the standard fields.
+    auto msg = fmt::format("{:<6s}{:<10s}{:<10s}{:<20d}{}", _username, _password, _session_name, _sequence,
+      _compress_requested ? std::string_view{"C"} : std::string_view{});
     dispatch('L', msg);
     asio::connect(_socket, _resolver.resolve(_host, _port));
+    apply_socket_options(_socket, _options);
   }
 
   void send_logout() { dispatch('O'); }
@@ -92,13 +142,164 @@ private:
     }
   }
 
+  /// @brief Checks the sequence number in the login accept against the next
+  /// one expected. Messages the server sends again are dropped and messages
+  /// which the server no longer has are counted as a gap.
+  void check_sequence(std::string_view accepted)
+  {
+    int next{};
+    if(std::from_chars(accepted.data(), accepted.data() + accepted.size(), next).ec != std::errc{})
+      return;
+    auto expected = _next_assigned;
+    if(next > expected)
+    {
+      spdlog::warn("{}: gap ({}-{}), messages not available", _session_name, expected, next - 1);
+      session_stats::add(_stats.gaps, static_cast<std::uint64_t>(next - expected));
+      _sequence = _next_assigned = next;
+      // Keep the store numbered like the stream, so the next login asks for
+      // the message after the last one received.
+      _database.skip_input(next);
+    }
+    else if(next < expected)
+    {
+      spdlog::info("{}: skipping ({}-{}) already received", _session_name, next, expected - 1);
+      _skip = expected - next;
+    }
+  }
+
+  /// @brief True if the message was received before and is dropped.
+  bool duplicate()
+  {
+    if(_skip == 0)
+      return false;
+    --_skip;
+    session_stats::add(_stats.duplicates);
+    return true;
+  }
+
   void process_sequenced(std::string_view msg)
   {
+    if(duplicate())
+      return;
+    ++_next_assigned;
+    auto start = std::chrono::steady_clock::now();
     _database.store_input(msg);
-    _handler->process_sequenced(*this, msg);
+    _stats.database_write(std::chrono::steady_clock::now() - start);
+    if constexpr(!is_awaitable<decltype(_handler->process_sequenced(*this, msg))>::value)
+      _handler->process_sequenced(*this, msg);
     ++_sequence;
   }
 
+  /// @brief Awaits handlers whose `process_sequenced` returns an
+  /// `asio::awaitable`. The message is stored before the handler runs and the
+  /// sequence number is incremented after it completes, as in the synchronous
+  /// case. Timers and writes run on the strand while the handler is
+  /// suspended, but the reader waits for it unless pipelining is enabled.
+  asio::awaitable<void> process_message_async(std::string msg) override
+  {
+    if constexpr(parallel_handler<Handler>)
+    {
+      if(_pool && !msg.empty() && msg[0] == 'S')
+      {
+        co_await fan_out(std::move(msg));
+        co_return;
+      }
+    }
+    if constexpr(is_awaitable<decltype(_handler->process_sequenced(*this, std::string_view{}))>::value)
+    {
+      if(!msg.empty() && msg[0] == 'S')
+      {
+        if(duplicate())
+          co_return;
+        ++_next_assigned;
+        auto data = std::string_view(msg).substr(1);
+        auto start = std::chrono::steady_clock::now();
+        _database.store_input(data);
+        _stats.database_write(std::chrono::steady_clock::now() - start);
+        co_await _handler->process_sequenced(*this, data);
+        ++_sequence;
+        co_return;
+      }
+    }
+    process_message(msg);
+  }
+
+  /// @brief Assigns the next sequence number to a message and hands it to a
+  /// worker. Waits while `_max_prepared` messages are in flight, on a timer of
+  /// its own since the pipeline waits on `_drained` at the same time.
+  asio::awaitable<void> fan_out(std::string msg)
+  {
+    if(duplicate())
+      co_return;
+    auto sequence = _next_assigned++;
+    auto self = std::static_pointer_cast<client_session>(shared_from_this());
+    asio::post(*_pool, [self = std::move(self), sequence, msg = std::move(msg)]() mutable {
+      auto& strand = self->_strand;
+      // An exception escaping a pool thread terminates the process, so it is
+      // handed to the strand, which stops the session.
+      std::optional<typename prepared_type<Handler>::type> prepared;
+      try
+      {
+        prepared.emplace(std::as_const(*self->_handler).prepare(std::string_view(msg).substr(1)));
+      }
+      catch(const std::exception& ex)
+      {
+        asio::post(strand, [self = std::move(self), what = std::string(ex.what())] {
+          spdlog::info("{}: exception: {}", self->_session_name, what);
+          self->stop();
+        });
+        return;
+      }
+      asio::post(strand, [self = std::move(self), sequence, msg = std::move(msg), p = std::move(*prepared)]() mutable {
+        self->_prepared.try_emplace(sequence, std::move(msg), std::move(p));
+        self->commit();
+      });
+    });
+    while(_socket.is_open() && static_cast<std::size_t>(_next_assigned - _sequence) >= _max_prepared)
+    {
+      _committed.expires_at(std::chrono::steady_clock::time_point::max());
+      asio::error_code ec;
+      co_await _committed.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+    }
+  }
+
+  /// @brief Applies prepared messages in sequence order. The contiguous run
+  /// of prepared messages is stored in one transaction before the handler
+  /// sees any of them.
+  void commit()
+  {
+    auto end = _prepared.begin();
+    auto sequence = _sequence;
+    while(end != _prepared.end() && end->first == sequence)
+      ++end, ++sequence;
+    if(end == _prepared.begin())
+      return;
+    try
+    {
+      std::vector<std::string_view> msgs;
+      for(auto i = _prepared.begin(); i != end; ++i)
+        msgs.push_back(std::string_view(i->second.first).substr(1));
+      auto start = std::chrono::steady_clock::now();
+      _database.store_input(msgs);
+      _stats.database_write(std::chrono::steady_clock::now() - start);
+      for(auto i = _prepared.begin(); i != end; ++i)
+      {
+        _handler->commit(*this, std::string_view(i->second.first).substr(1), std::move(i->second.second));
+        ++_sequence;
+      }
+    }
+    catch(const std::exception& ex)
+    {
+      spdlog::info("{}: exception: {}", _session_name, ex.what());
+      stop();
+    }
+    _prepared.erase(_prepared.begin(), end);
+    session_stats::set(_stats.sequence, _sequence);
+    _committed.cancel();
+  }
+
+  void stopped() override { _committed.cancel(); }
+
   void process_message(std::string_view msg) override
   {
     switch(msg[0])
@@ -112,6 +313,9 @@ private:
         break;
       case 'A':
         spdlog::info("login accept {}", std::tuple(trim(msg.substr(1, 10)), trim(msg.substr(11, 20))));
+        check_sequence(trim(msg.substr(11, 20)));
+        if(msg.size() > 31 && msg[31] == compressed_type)
+          spdlog::info("{}: compression enabled", _session_name);
         break;
       case 'U':
         break;
@@ -134,7 +338,23 @@ private:
   std::string _port;
   std::string _username;
   std::string _password;
+  socket_options _options;
+  bool _compress_requested{false};
   asio::ip::tcp::resolver _resolver;
   database _database;
+
+  /// @brief Messages in flight per worker before the reader waits.
+  static constexpr std::size_t prepared_per_worker{64};
+
+  std::unique_ptr<asio::thread_pool> _pool;
+  std::size_t _max_prepared{0};
+  /// @brief Cancelled by `commit` to wake up a `fan_out` waiting for room.
+  asio::steady_timer _committed;
+  /// @brief The sequence number given to the next message received.
+  int _next_assigned{1};
+  /// @brief The number of messages still to be dropped as duplicates.
+  int _skip{0};
+  /// @brief Prepared messages waiting for their turn to be committed.
+  std::map<int, std::pair<std::string, typename prepared_type<Handler>::type>> _prepared;
 };
 } // namespace fixme::soupstock
@@ -16,12 +16,65 @@
 
 #pragma once
 
+#include <algorithm>
+#include <arpa/inet.h>
+#include <charconv>
+#include <chrono>
+#include <fcntl.h>
+#include <filesystem>
 #include <fmt/format.h>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <span>
 #include <string>
 #include <sqlite3.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
 
 namespace fixme
 {
+/// @brief When the live segment of a database is rolled over and what happens
+/// to old segments.
+struct segment_policy
+{
+  /// @brief Roll over when the live segment grows beyond this many bytes. Zero
+  /// disables size based rollover.
+  std::uintmax_t max_bytes{0};
+  /// @brief Roll over when the live segment is older than this. Zero disables
+  /// time based rollover.
+  std::chrono::seconds max_age{0};
+  /// @brief The number of segments to keep, including the live segment. Zero
+  /// keeps all segments.
+  std::size_t max_segments{0};
+  /// @brief Segments beyond `max_segments` are moved here. If empty they are
+  /// deleted.
+  std::string archive_directory;
+  /// @brief Also keep the output stream in SoupBinTCP wire format so that
+  /// replays can be sent straight from the file, see `database::wire_output`.
+  bool wire_log{false};
+};
+
+/// @brief Message store for the input and output streams of a session.
+///
+/// Messages are stored as BLOBs so that binary payloads survive unchanged.
+///
+/// The store is split into segments. The first segment is the file given to
+/// `open`, subsequent segments have the segment number appended, e.g.
+/// `server-session1.db.2`. New messages go to the live segment, which is the
+/// one with the highest number. Each segment records the first input and
+/// output sequence numbers it holds so that sequence numbers continue across
+/// segments and replay works even when older segments have been removed.
+///
+/// With `segment_policy::wire_log` every output message is also appended to
+/// `{segment}.wire` as a framed sequenced data packet, i.e. the two byte
+/// length, 'S' and the message. `{segment}.index` holds the eight byte file
+/// offset of each frame, indexed by the sequence number relative to the first
+/// one in the segment. Both are written after the message is committed, so a
+/// frame which is in the index is always complete. A segment whose index
+/// doesn't match its table, e.g. after a crash, stops extending the wire log
+/// and replays of the rest of it come from the table.
 class database
 {
 public:
@@ -31,21 +84,284 @@ public:
     std::string message;
   };
 
-  void open(const std::string& filename)
+  /// @brief A contiguous run of framed messages in a wire log.
+  struct wire_range
+  {
+    std::shared_ptr<const int> file;
+    std::uint64_t offset;
+    std::size_t length;
+    int first;
+    int last;
+  };
+
+  database() = default;
+  database(const database&) = delete;
+  database& operator=(const database&) = delete;
+
+  ~database()
+  {
+    close_cursor();
+    close_live();
+  }
+
+  void open(const std::string& filename, segment_policy policy = {})
   {
     if(_db_handle != nullptr)
       return;
-    if(auto ec = sqlite3_open(filename.c_str(), &_db_handle); ec != SQLITE_OK)
-      throw std::runtime_error(fmt::format("sqlite3 error {}", sqlite3_errmsg(_db_handle)));
-    char* error{nullptr};
-    auto ec = sqlite3_exec(_db_handle, R"(
-create table if not exists input
-(sequence integer primary key autoincrement, message text);
-create table if not exists output
-(sequence integer primary key autoincrement, message text)
-)",
-      nullptr, nullptr, &error);
+    _filename = filename;
+    _policy = std::move(policy);
+    discover();
+    if(_segments.empty())
+      _segments.push_back(segment{0, _filename});
+    // A crash in roll_over can leave the newest segment without its segment
+    // row. It continues where the segment before it ends, not at one.
+    auto [first_input, first_output] =
+      _segments.size() > 1 ? following(_segments[_segments.size() - 2]) : std::pair{1, 1};
+    open_live(first_input, first_output, true);
+    apply_retention();
+  }
+
+  /// @brief Opens the store of another session for reading, e.g. the store
+  /// which a replication session sends to a standby.
+  ///
+  /// A reader never writes to the store. It follows the segments as the
+  /// owner creates them, and a store which doesn't exist yet reads as empty
+  /// until the owner creates it.
+  void open_reader(const std::string& filename)
+  {
+    if(_db_handle != nullptr || _reader)
+      return;
+    _filename = filename;
+    _reader = true;
+    discover();
+    follow();
+  }
+
+  /// @brief Stores a message in the output stream and returns its sequence
+  /// number.
+  int store_output(std::string_view msg)
+  {
+    auto sequence = _next_output;
+    insert(_insert_output, sequence, msg);
+    _next_output = sequence + 1;
+    append_wire(sequence, std::span(&msg, 1));
+    roll_over(msg.size());
+    return sequence;
+  }
+
+  /// @brief Stores a block of messages in the output stream in one
+  /// transaction and returns the sequence number of the first message. The
+  /// messages get consecutive sequence numbers.
+  int store_output(std::span<const std::string_view> msgs)
+  {
+    auto first = _next_output;
+    auto written = insert_block(_insert_output, _next_output, msgs);
+    append_wire(first, msgs);
+    roll_over(written, msgs.size());
+    return first;
+  }
+
+  /// @brief Stores a message received from a primary server using the
+  /// sequence number assigned by the primary.
+  void replicate_output(int sequence, std::string_view msg)
+  {
+    insert(_insert_output, sequence, msg);
+    _next_output = std::max(_next_output, sequence + 1);
+    append_wire(sequence, std::span(&msg, 1));
+    roll_over(msg.size());
+  }
+
+  /// @brief Returns the highest sequence number in the output stream or zero
+  /// if the stream is empty.
+  ///
+  /// The live segment is queried since messages may have been stored through
+  /// another connection to the same database.
+  int last_output()
+  {
+    refresh();
+    if(_db_handle == nullptr)
+      return _next_output - 1;
+    _next_output = std::max(_next_output, last(_db_handle, "output") + 1);
+    return _next_output - 1;
+  }
+
+  /// @brief Returns the first sequence number still in the output stream, or
+  /// the next one if the stream is empty. Older messages have been dropped
+  /// by the retention policy.
+  int first_output()
+  {
+    refresh();
+    if(_segments.empty())
+      return _next_output;
+    auto& oldest = _segments.front();
+    if(!oldest.first_output)
+      load_bounds(oldest);
+    return *oldest.first_output;
+  }
+
+  /// @brief Loads output messages starting at `sequence`. Stops once the
+  /// messages loaded add up to `max_bytes`, so the last message may overshoot
+  /// the limit.
+  std::vector<row> load_output(int sequence, std::size_t max_bytes = std::numeric_limits<std::size_t>::max())
+  {
+    refresh();
+    return load("output", &segment::first_output, sequence, max_bytes);
+  }
+
+  /// @brief Loads output messages like `load_output`, for a replay which
+  /// moves forward through the stream in steps.
+  ///
+  /// The segment and the prepared statement of the last step are kept, so a
+  /// step which starts where the last one stopped neither looks up the
+  /// segment nor prepares the query again. No statement is left running
+  /// between steps. Returns fewer than `max_bytes` only at the end of the
+  /// stream as known when the step started.
+  std::vector<row> read_output(int sequence, std::size_t max_bytes)
+  {
+    std::vector<row> rows;
+    std::size_t bytes{0};
+    while(bytes < max_bytes)
+    {
+      if(!seek_cursor(sequence))
+        break;
+      sqlite3_bind_int(_cursor.stmt, 1, sequence);
+      int ec;
+      while(bytes < max_bytes && (ec = sqlite3_step(_cursor.stmt)) == SQLITE_ROW)
+      {
+        rows.push_back(row{sqlite3_column_int(_cursor.stmt, 0), column_message(_cursor.stmt, 1)});
+        bytes += rows.back().message.size();
+        sequence = rows.back().sequence + 1;
+      }
+      sqlite3_reset(_cursor.stmt);
+      if(bytes >= max_bytes)
+        break;
+      if(ec != SQLITE_DONE)
+        throw std::runtime_error(fmt::format("step: {}", sqlite3_errmsg(_cursor.db)));
+      // The rest of the stream is in the next segment, if there is one.
+      auto next = std::ranges::find(_segments, _cursor.number, &segment::number);
+      if(next == _segments.end() || ++next == _segments.end())
+        break;
+      close_cursor();
+      _cursor.number = next->number;
+      _cursor.next = sequence;
+    }
+    _cursor.next = sequence;
+    return rows;
+  }
+
+  /// @brief Finds framed output messages starting at `sequence` in the wire
+  /// log, adding up to about `max_bytes` but at least one message. The range
+  /// never spans segments. Returns `std::nullopt` if `sequence` isn't in the
+  /// wire log, in which case `load_output` has it.
+  std::optional<wire_range> wire_output(int sequence, std::size_t max_bytes)
+  {
+    refresh();
+    if(_segments.empty())
+      return std::nullopt;
+    auto& s = _segments[find_segment(&segment::first_output, sequence)];
+    if(!s.first_output)
+      load_bounds(s);
+    if(_wire_reader.number != s.number || !_wire_reader.wire || !_wire_reader.index)
+    {
+      _wire_reader = wire_reader{s.number, open_file(wire_path(s.path), O_RDONLY),
+        open_file(index_path(s.path), O_RDONLY)};
+    }
+    if(!_wire_reader.wire || !_wire_reader.index || sequence < *s.first_output)
+      return std::nullopt;
+    struct stat st;
+    if(::fstat(*_wire_reader.index, &st) != 0)
+      return std::nullopt;
+    auto position = static_cast<std::uint64_t>(sequence - *s.first_output);
+    auto entries = static_cast<std::uint64_t>(st.st_size) / sizeof(std::uint64_t);
+    if(position >= entries)
+      return std::nullopt;
+    // Read one offset more than the frames returned, the end of the last
+    // frame is the start of the next one.
+    std::vector<std::uint64_t> offsets(std::min<std::uint64_t>(entries - position, max_index_read));
+    auto bytes = static_cast<ssize_t>(offsets.size() * sizeof(std::uint64_t));
+    if(::pread(*_wire_reader.index, offsets.data(), bytes, static_cast<off_t>(position * sizeof(std::uint64_t)))
+      != bytes)
+      return std::nullopt;
+    std::size_t count{1};
+    while(count + 1 < offsets.size() && offsets[count + 1] - offsets[0] <= max_bytes)
+      ++count;
+    std::uint64_t end{0};
+    if(count < offsets.size())
+      end = offsets[count];
+    else
+    {
+      // The last indexed frame, read its length from the wire log.
+      std::uint16_t length;
+      if(::pread(*_wire_reader.wire, &length, sizeof(length), static_cast<off_t>(offsets[count - 1])) != sizeof(length))
+        return std::nullopt;
+      end = offsets[count - 1] + sizeof(length) + ntohs(length);
+    }
+    return wire_range{_wire_reader.wire, offsets[0], static_cast<std::size_t>(end - offsets[0]), sequence,
+      sequence + static_cast<int>(count) - 1};
+  }
+
+  /// @brief Stores a message in the input stream and returns its sequence
+  /// number.
+  int store_input(std::string_view msg)
+  {
+    auto sequence = _next_input;
+    insert(_insert_input, sequence, msg);
+    _next_input = sequence + 1;
+    roll_over(msg.size());
+    return sequence;
+  }
+
+  /// @brief Stores a block of messages in the input stream in one
+  /// transaction and returns the sequence number of the first message.
+  int store_input(std::span<const std::string_view> msgs)
+  {
+    auto first = _next_input;
+    auto written = insert_block(_insert_input, _next_input, msgs);
+    roll_over(written, msgs.size());
+    return first;
+  }
+
+  /// @brief Continues the input stream at `sequence`, e.g. when the peer no
+  /// longer has the messages before it. The next message stored gets this
+  /// sequence number.
+  void skip_input(int sequence) { _next_input = std::max(_next_input, sequence); }
+
+  /// @brief Returns the highest sequence number in the input stream or zero
+  /// if the stream is empty.
+  int last_input()
+  {
+    refresh();
+    if(_db_handle == nullptr)
+      return _next_input - 1;
+    _next_input = std::max(_next_input, last(_db_handle, "input") + 1);
+    return _next_input - 1;
+  }
+
+  std::vector<row> load_input()
+  {
+    refresh();
+    return load("input", &segment::first_input, 1);
+  }
+
+private:
+  struct segment
+  {
+    int number;
+    std::filesystem::path path;
+    std::optional<int> first_input;
+    std::optional<int> first_output;
+  };
+
+  static void check(sqlite3* db, int ec, std::string_view what)
+  {
     if(ec != SQLITE_OK)
+      throw std::runtime_error(fmt::format("{}: {}", what, sqlite3_errmsg(db)));
+  }
+
+  static void exec(sqlite3* db, const char* sql)
+  {
+    char* error{nullptr};
+    if(sqlite3_exec(db, sql, nullptr, nullptr, &error) != SQLITE_OK)
     {
       std::string error_message{error};
       sqlite3_free(error);
@@ -53,85 +369,573 @@ create table if not exists output
     }
   }
 
-  void store_output(std::string_view msg)
+  static sqlite3_stmt* prepare(sqlite3* db, std::string_view sql)
   {
     sqlite3_stmt* stmt{nullptr};
-    std::string sql{R"(insert into output (message) values (?))"};
-    auto ec = sqlite3_prepare(_db_handle, sql.c_str(), static_cast<int>(sql.length()), &stmt, nullptr);
-    if(ec != SQLITE_OK)
-      throw std::runtime_error(fmt::format("{}", sqlite3_errmsg(_db_handle)));
-    sqlite3_bind_text(stmt, 1, msg.data(), msg.size(), SQLITE_STATIC);
-    ec = sqlite3_step(stmt);
-    if(ec != SQLITE_DONE)
+    check(db, sqlite3_prepare_v2(db, sql.data(), static_cast<int>(sql.length()), &stmt, nullptr), "prepare");
+    return stmt;
+  }
+
+  /// @brief Returns the message column without a round trip through a C
+  /// string, so embedded NULs are preserved.
+  static std::string column_message(sqlite3_stmt* stmt, int column)
+  {
+    auto* data = static_cast<const char*>(sqlite3_column_blob(stmt, column));
+    auto length = sqlite3_column_bytes(stmt, column);
+    if(data == nullptr || length <= 0)
+      return {};
+    return {data, static_cast<std::size_t>(length)};
+  }
+
+  /// @brief Finds the segments on disk belonging to this database.
+  void discover()
+  {
+    std::vector<segment> segments;
+    auto directory = _filename.parent_path().empty() ? std::filesystem::path(".") : _filename.parent_path();
+    auto prefix = _filename.filename().string() + ".";
+    std::error_code ec;
+    if(std::filesystem::exists(_filename, ec))
+      segments.push_back(segment{0, _filename});
+    for(const auto& entry: std::filesystem::directory_iterator(directory, ec))
     {
-      ec = sqlite3_finalize(stmt);
-      throw std::runtime_error(fmt::format("step: {}", sqlite3_errmsg(_db_handle)));
+      auto name = entry.path().filename().string();
+      if(!name.starts_with(prefix))
+        continue;
+      auto suffix = std::string_view(name).substr(prefix.length());
+      int number{};
+      auto [ptr, error] = std::from_chars(suffix.data(), suffix.data() + suffix.length(), number);
+      if(error != std::errc{} || ptr != suffix.data() + suffix.length() || number <= 0)
+        continue;
+      segments.push_back(segment{number, entry.path()});
     }
-    ec = sqlite3_finalize(stmt);
-    if(ec != SQLITE_OK)
-      throw std::runtime_error(fmt::format("finalize: {}", sqlite3_errmsg(_db_handle)));
+    std::ranges::sort(segments, {}, &segment::number);
+    // Keep what is already known about segments which are still there.
+    for(auto& s: segments)
+      if(auto known = std::ranges::find(_segments, s.number, &segment::number); known != _segments.end())
+        s = *known;
+    _segments = std::move(segments);
   }
 
-  std::vector<row> load_output(int sequence)
+  static std::filesystem::path segment_path(const std::filesystem::path& filename, int number)
   {
-    std::vector<row> rows;
-    std::string sql{fmt::format(R"(select * from output where sequence >= {})", sequence)};
-    sqlite3_stmt* stmt{nullptr};
-    auto ec = sqlite3_prepare(_db_handle, sql.c_str(), static_cast<int>(sql.length()), &stmt, nullptr);
-    while(true)
+    return number == 0 ? filename : std::filesystem::path(fmt::format("{}.{}", filename.string(), number));
+  }
+
+  /// @brief Picks up segments created or removed through another connection
+  /// to the same store, e.g. by the owner of a store which a reader follows.
+  ///
+  /// Rather than scanning the directory on every call only the files of the
+  /// next segment and of the oldest known one are checked.
+  void refresh()
+  {
+    std::error_code ec;
+    auto next = segment_path(_filename, _segments.empty() ? 0 : _segments.back().number + 1);
+    auto added = std::filesystem::exists(next, ec);
+    auto removed = _segments.size() > 1 && !std::filesystem::exists(_segments.front().path, ec);
+    if(!added && !removed)
+      return;
+    discover();
+    follow();
+  }
+
+  /// @brief Makes the newest complete segment the live one. A segment which
+  /// its owner is still creating is left for the next refresh.
+  void follow()
+  {
+    while(!_segments.empty() && (_db_handle == nullptr || _segments.back().number != _live))
     {
-      ec = sqlite3_step(stmt);
-      if(ec == SQLITE_ROW)
-        rows.push_back(row{sqlite3_column_int(stmt, 0), reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1))});
-      else if(ec == SQLITE_DONE)
-        break;
+      if(open_live(_next_input, _next_output, false))
+        return;
+      _segments.pop_back();
     }
-    ec = sqlite3_finalize(stmt);
-    if(ec != SQLITE_OK)
-      throw std::runtime_error(fmt::format("finalize: {}", sqlite3_errmsg(_db_handle)));
-    return rows;
   }
 
-  void store_input(std::string_view msg)
+  /// @brief Opens the segment with the highest number as the live segment.
+  ///
+  /// With `create`, which only the owner of the store uses, the tables and
+  /// the segment row are created if they don't exist, in one transaction so
+  /// that other connections never see a partial segment. Without it the
+  /// segment is only opened if it is complete. Returns false if it isn't, in
+  /// which case the current live segment stays open.
+  bool open_live(int first_input, int first_output, bool create)
   {
-    std::string sql{fmt::format(R"(insert into input (message) values (?))")};
-    sqlite3_stmt* stmt{nullptr};
-    auto ec = sqlite3_prepare(_db_handle, sql.c_str(), static_cast<int>(sql.length()), &stmt, nullptr);
-    if(ec != SQLITE_OK)
-      throw std::runtime_error(fmt::format("{}", sqlite3_errmsg(_db_handle)));
-    sqlite3_bind_text(stmt, 1, msg.data(), msg.size(), SQLITE_STATIC);
-    ec = sqlite3_step(stmt);
-    if(ec != SQLITE_DONE)
+    auto& live = _segments.back();
+    sqlite3* db{nullptr};
+    auto flags = _reader ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+    if(sqlite3_open_v2(live.path.c_str(), &db, flags, nullptr) != SQLITE_OK)
+    {
+      std::string error{sqlite3_errmsg(db)};
+      sqlite3_close(db);
+      if(!create)
+        return false;
+      throw std::runtime_error(fmt::format("sqlite3 error {}", error));
+    }
+    std::optional<std::chrono::system_clock::time_point> created;
+    try
     {
-      ec = sqlite3_finalize(stmt);
+      if(create)
+      {
+        exec(db, R"(
+begin immediate;
+create table if not exists input
+(sequence integer primary key, message blob);
+create table if not exists output
+(sequence integer primary key, message blob);
+create table if not exists segment
+(created integer, first_input integer, first_output integer)
+)");
+      }
+      sqlite3_stmt* stmt{nullptr};
+      std::string_view sql{R"(select created, first_input, first_output from segment)"};
+      if(sqlite3_prepare_v2(db, sql.data(), static_cast<int>(sql.length()), &stmt, nullptr) == SQLITE_OK
+        && sqlite3_step(stmt) == SQLITE_ROW)
+      {
+        created = std::chrono::system_clock::time_point(std::chrono::seconds(sqlite3_column_int64(stmt, 0)));
+        first_input = sqlite3_column_int(stmt, 1);
+        first_output = sqlite3_column_int(stmt, 2);
+      }
+      sqlite3_finalize(stmt);
+      if(!created && create)
+      {
+        created = std::chrono::system_clock::now();
+        auto seconds = std::chrono::duration_cast<std::chrono::seconds>(created->time_since_epoch());
+        stmt = prepare(db, R"(insert into segment (created, first_input, first_output) values (?, ?, ?))");
+        sqlite3_bind_int64(stmt, 1, seconds.count());
+        sqlite3_bind_int(stmt, 2, first_input);
+        sqlite3_bind_int(stmt, 3, first_output);
+        auto ec = sqlite3_step(stmt);
+        sqlite3_finalize(stmt);
+        if(ec != SQLITE_DONE)
+          throw std::runtime_error(fmt::format("step: {}", sqlite3_errmsg(db)));
+      }
+      if(create)
+        exec(db, "commit");
+    }
+    catch(const std::exception&)
+    {
+      sqlite3_close(db);
+      throw;
+    }
+    if(!created)
+    {
+      sqlite3_close(db);
+      return false;
+    }
+    close_live();
+    _db_handle = db;
+    _created = *created;
+    live.first_input = first_input;
+    live.first_output = first_output;
+    _next_input = std::max(first_input, last(_db_handle, "input") + 1);
+    _next_output = std::max(first_output, last(_db_handle, "output") + 1);
+    if(!_reader)
+    {
+      _insert_input = prepare(_db_handle, R"(insert into input (sequence, message) values (?, ?))");
+      _insert_output = prepare(_db_handle, R"(insert into output (sequence, message) values (?, ?))");
+    }
+    _live = live.number;
+    std::error_code ec;
+    _live_bytes = std::filesystem::file_size(live.path, ec);
+    if(_policy.wire_log && !_reader)
+      open_wire(live, first_output);
+    return true;
+  }
+
+  static std::filesystem::path wire_path(const std::filesystem::path& path) { return path.string() + ".wire"; }
+  static std::filesystem::path index_path(const std::filesystem::path& path) { return path.string() + ".index"; }
+
+  /// @brief Opens a file descriptor which is closed with the last reference.
+  static std::shared_ptr<const int> open_file(const std::filesystem::path& path, int flags)
+  {
+    auto fd = ::open(path.c_str(), flags | O_CLOEXEC, 0644);
+    if(fd < 0)
+      return nullptr;
+    return std::shared_ptr<const int>(new int(fd), [](const int* p) {
+      ::close(*p);
+      delete p;
+    });
+  }
+
+  /// @brief Opens the wire log of the live segment for appending. The log is
+  /// only extended if its index matches the output table.
+  void open_wire(const segment& live, int first_output)
+  {
+    _wire = open_file(wire_path(live.path), O_WRONLY | O_CREAT | O_APPEND);
+    _index = open_file(index_path(live.path), O_WRONLY | O_CREAT | O_APPEND);
+    struct stat wire;
+    struct stat index;
+    if(!_wire || !_index || ::fstat(*_wire, &wire) != 0 || ::fstat(*_index, &index) != 0
+      || first_output + index.st_size / static_cast<off_t>(sizeof(std::uint64_t)) != _next_output)
+    {
+      _wire.reset();
+      _index.reset();
+      return;
+    }
+    _wire_end = static_cast<std::uint64_t>(wire.st_size);
+    _wire_next = _next_output;
+  }
+
+  /// @brief Appends committed output messages to the wire log, first the
+  /// frames and then their offsets.
+  void append_wire(int sequence, std::span<const std::string_view> msgs)
+  {
+    if(!_wire)
+      return;
+    if(sequence != _wire_next)
+    {
+      // Out of order, e.g. replicated with a gap. The index would no longer
+      // line up with the sequence numbers.
+      _wire.reset();
+      _index.reset();
+      return;
+    }
+    std::string frames;
+    std::vector<std::uint64_t> offsets;
+    offsets.reserve(msgs.size());
+    for(auto msg: msgs)
+    {
+      offsets.push_back(_wire_end + frames.size());
+      auto length = htons(static_cast<std::uint16_t>(msg.size() + 1));
+      frames.append(reinterpret_cast<const char*>(&length), sizeof(length));
+      frames.push_back('S');
+      frames.append(msg);
+    }
+    if(!write_all(*_wire, frames.data(), frames.size())
+      || !write_all(*_index, offsets.data(), offsets.size() * sizeof(std::uint64_t)))
+    {
+      _wire.reset();
+      _index.reset();
+      return;
+    }
+    _wire_end += frames.size();
+    _wire_next = sequence + static_cast<int>(msgs.size());
+  }
+
+  static bool write_all(int fd, const void* data, std::size_t size)
+  {
+    auto* p = static_cast<const char*>(data);
+    while(size > 0)
+    {
+      auto n = ::write(fd, p, size);
+      if(n < 0 && errno == EINTR)
+        continue;
+      if(n <= 0)
+        return false;
+      p += n;
+      size -= static_cast<std::size_t>(n);
+    }
+    return true;
+  }
+
+  void close_live()
+  {
+    if(_db_handle == nullptr)
+      return;
+    if(_cursor.db == _db_handle)
+      close_cursor();
+    sqlite3_finalize(_insert_input);
+    sqlite3_finalize(_insert_output);
+    _insert_input = nullptr;
+    _insert_output = nullptr;
+    sqlite3_close(_db_handle);
+    _db_handle = nullptr;
+    _wire.reset();
+    _index.reset();
+  }
+
+  static int last(sqlite3* db, std::string_view table)
+  {
+    auto* stmt = prepare(db, fmt::format(R"(select coalesce(max(sequence), 0) from {})", table));
+    int sequence{0};
+    if(sqlite3_step(stmt) == SQLITE_ROW)
+      sequence = sqlite3_column_int(stmt, 0);
+    check(db, sqlite3_finalize(stmt), "finalize");
+    return sequence;
+  }
+
+  void insert(sqlite3_stmt* stmt, int sequence, std::string_view msg)
+  {
+    if(stmt == nullptr)
+      throw std::runtime_error(fmt::format("{}: opened for reading", _filename.string()));
+    sqlite3_bind_int(stmt, 1, sequence);
+    sqlite3_bind_blob(stmt, 2, msg.data(), static_cast<int>(msg.size()), SQLITE_STATIC);
+    auto ec = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    if(ec != SQLITE_DONE)
       throw std::runtime_error(fmt::format("step: {}", sqlite3_errmsg(_db_handle)));
+  }
+
+  /// @brief Inserts a block of messages in one transaction, numbered from
+  /// `next`, which is advanced past them. On failure the transaction is
+  /// rolled back and `next` is left unchanged. Returns the bytes written.
+  std::size_t insert_block(sqlite3_stmt* stmt, int& next, std::span<const std::string_view> msgs)
+  {
+    auto first = next;
+    std::size_t written{0};
+    exec(_db_handle, "begin");
+    try
+    {
+      for(auto msg: msgs)
+      {
+        insert(stmt, next, msg);
+        ++next;
+        written += msg.size();
+      }
+      exec(_db_handle, "commit");
     }
-    ec = sqlite3_finalize(stmt);
-    if(ec != SQLITE_OK)
-      throw std::runtime_error(fmt::format("finalize: {}", sqlite3_errmsg(_db_handle)));
+    catch(const std::exception&)
+    {
+      sqlite3_exec(_db_handle, "rollback", nullptr, nullptr, nullptr);
+      next = first;
+      throw;
+    }
+    return written;
   }
 
-  std::vector<row> load_input()
+  /// @brief Starts a new live segment if the current one is too large or too
+  /// old.
+  void roll_over(std::size_t written, std::size_t rows = 1)
   {
-    std::vector<row> rows;
+    // Approximate the file growth rather than asking the file system on every
+    // insert.
+    _live_bytes += written + rows * row_overhead;
+    auto too_large = _policy.max_bytes > 0 && _live_bytes >= _policy.max_bytes;
+    auto too_old = _policy.max_age.count() > 0 && std::chrono::system_clock::now() - _created >= _policy.max_age;
+    if(!too_large && !too_old)
+      return;
+    close_live();
+    auto number = _segments.back().number + 1;
+    _segments.push_back(segment{number, segment_path(_filename, number)});
+    open_live(_next_input, _next_output, true);
+    apply_retention();
+  }
+
+  /// @brief Archives or drops the oldest segments beyond `max_segments`.
+  void apply_retention()
+  {
+    if(_policy.max_segments == 0)
+      return;
+    while(_segments.size() > _policy.max_segments)
+    {
+      auto& oldest = _segments.front();
+      std::error_code ec;
+      if(_policy.archive_directory.empty())
+        std::filesystem::remove(oldest.path, ec);
+      else
+      {
+        std::filesystem::create_directories(_policy.archive_directory, ec);
+        auto archived = std::filesystem::path(_policy.archive_directory) / oldest.path.filename();
+        std::filesystem::rename(oldest.path, archived, ec);
+      }
+      if(ec)
+        throw std::runtime_error(fmt::format("retention: {}: {}", oldest.path.string(), ec.message()));
+      // The wire log goes with its segment. It may not exist.
+      for(const auto& path: {wire_path(oldest.path), index_path(oldest.path)})
+      {
+        if(_policy.archive_directory.empty())
+          std::filesystem::remove(path, ec);
+        else
+          std::filesystem::rename(path, std::filesystem::path(_policy.archive_directory) / path.filename(), ec);
+      }
+      if(_wire_reader.number == oldest.number)
+        _wire_reader = {};
+      _segments.erase(_segments.begin());
+    }
+  }
+
+  /// @brief Reads the first sequence numbers of a closed segment.
+  void load_bounds(segment& s)
+  {
+    sqlite3* db{nullptr};
+    if(sqlite3_open_v2(s.path.c_str(), &db, SQLITE_OPEN_READONLY, nullptr) != SQLITE_OK)
+    {
+      std::string error{sqlite3_errmsg(db)};
+      sqlite3_close(db);
+      throw std::runtime_error(fmt::format("sqlite3 error {}", error));
+    }
+    // Segments written before segmentation existed have no segment table and
+    // always start at one.
+    s.first_input = 1;
+    s.first_output = 1;
     sqlite3_stmt* stmt{nullptr};
-    std::string sql{fmt::format(R"(select * from input where sequence >= {})", 1)};
-    auto ec = sqlite3_prepare(_db_handle, sql.c_str(), static_cast<int>(sql.length()), &stmt, nullptr);
-    while(true)
-    {
-      ec = sqlite3_step(stmt);
-      if(ec == SQLITE_ROW)
-        rows.push_back(row{sqlite3_column_int(stmt, 0), reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1))});
-      else if(ec == SQLITE_DONE)
+    std::string_view sql{R"(select first_input, first_output from segment)"};
+    if(sqlite3_prepare_v2(db, sql.data(), static_cast<int>(sql.length()), &stmt, nullptr) == SQLITE_OK
+      && sqlite3_step(stmt) == SQLITE_ROW)
+    {
+      s.first_input = sqlite3_column_int(stmt, 0);
+      s.first_output = sqlite3_column_int(stmt, 1);
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+  }
+
+  /// @brief Returns the input and output sequence numbers which follow the
+  /// last rows of a closed segment.
+  std::pair<int, int> following(segment& s)
+  {
+    load_bounds(s);
+    sqlite3* db{nullptr};
+    if(sqlite3_open_v2(s.path.c_str(), &db, SQLITE_OPEN_READONLY, nullptr) != SQLITE_OK)
+    {
+      std::string error{sqlite3_errmsg(db)};
+      sqlite3_close(db);
+      throw std::runtime_error(fmt::format("sqlite3 error {}", error));
+    }
+    try
+    {
+      std::pair next{
+        std::max(*s.first_input, last(db, "input") + 1), std::max(*s.first_output, last(db, "output") + 1)};
+      sqlite3_close(db);
+      return next;
+    }
+    catch(const std::exception&)
+    {
+      sqlite3_close(db);
+      throw;
+    }
+  }
+
+  /// @brief Returns the index of the segment which holds `sequence`.
+  std::size_t find_segment(std::optional<int> segment::* first, int sequence)
+  {
+    auto start = _segments.size() - 1;
+    while(start > 0)
+    {
+      if(!(_segments[start].*first))
+        load_bounds(_segments[start]);
+      if(*(_segments[start].*first) <= sequence)
         break;
+      --start;
+    }
+    return start;
+  }
+
+  /// @brief Loads rows with a sequence number greater than or equal to
+  /// `sequence`, starting in the segment which holds it, until the messages
+  /// add up to `max_bytes`.
+  std::vector<row> load(std::string_view table, std::optional<int> segment::* first, int sequence,
+    std::size_t max_bytes = std::numeric_limits<std::size_t>::max())
+  {
+    if(_segments.empty())
+      return {};
+    auto start = find_segment(first, sequence);
+    std::vector<row> rows;
+    std::size_t bytes{0};
+    auto sql = fmt::format(R"(select sequence, message from {} where sequence >= ? order by sequence)", table);
+    for(auto i = start; i < _segments.size() && bytes < max_bytes; ++i)
+    {
+      auto live = _segments[i].number == _live;
+      sqlite3* db{_db_handle};
+      if(!live && sqlite3_open_v2(_segments[i].path.c_str(), &db, SQLITE_OPEN_READONLY, nullptr) != SQLITE_OK)
+      {
+        std::string error{sqlite3_errmsg(db)};
+        sqlite3_close(db);
+        throw std::runtime_error(fmt::format("sqlite3 error {}", error));
+      }
+      auto* stmt = prepare(db, sql);
+      sqlite3_bind_int(stmt, 1, sequence);
+      int ec;
+      while(bytes < max_bytes && (ec = sqlite3_step(stmt)) == SQLITE_ROW)
+      {
+        rows.push_back(row{sqlite3_column_int(stmt, 0), column_message(stmt, 1)});
+        bytes += rows.back().message.size();
+      }
+      sqlite3_finalize(stmt);
+      if(bytes < max_bytes && ec != SQLITE_DONE)
+      {
+        std::string error{sqlite3_errmsg(db)};
+        if(!live)
+          sqlite3_close(db);
+        throw std::runtime_error(fmt::format("step: {}", error));
+      }
+      if(!live)
+        sqlite3_close(db);
     }
-    ec = sqlite3_finalize(stmt);
-    if(ec != SQLITE_OK)
-      throw std::runtime_error(fmt::format("finalize: {}", sqlite3_errmsg(_db_handle)));
     return rows;
   }
 
-private:
+  /// @brief Points the cursor at the segment which holds `sequence`, keeping
+  /// the current one if the cursor was left at `sequence`. Returns false if
+  /// there is nothing to read.
+  bool seek_cursor(int sequence)
+  {
+    if(_segments.empty())
+      return false;
+    auto known = std::ranges::find(_segments, _cursor.number, &segment::number);
+    if(_cursor.stmt != nullptr && _cursor.next == sequence && known != _segments.end())
+      return true;
+    // The cursor was moved on to the next segment, which isn't open yet.
+    if(!(_cursor.stmt == nullptr && _cursor.next == sequence && known != _segments.end()))
+    {
+      close_cursor();
+      known = _segments.begin() + static_cast<std::ptrdiff_t>(find_segment(&segment::first_output, sequence));
+    }
+    _cursor.number = known->number;
+    if(_cursor.number == _live && _db_handle != nullptr)
+      _cursor.db = _db_handle;
+    else if(sqlite3_open_v2(known->path.c_str(), &_cursor.db, SQLITE_OPEN_READONLY, nullptr) != SQLITE_OK)
+    {
+      std::string error{sqlite3_errmsg(_cursor.db)};
+      sqlite3_close(_cursor.db);
+      _cursor = cursor{};
+      throw std::runtime_error(fmt::format("sqlite3 error {}", error));
+    }
+    _cursor.stmt = prepare(_cursor.db, R"(select sequence, message from output where sequence >= ? order by sequence)");
+    _cursor.next = sequence;
+    return true;
+  }
+
+  /// @brief Finalizes the cursor's statement and closes its segment unless
+  /// it is the live one. The segment number is kept.
+  void close_cursor()
+  {
+    sqlite3_finalize(_cursor.stmt);
+    if(_cursor.db != nullptr && _cursor.db != _db_handle)
+      sqlite3_close(_cursor.db);
+    _cursor.stmt = nullptr;
+    _cursor.db = nullptr;
+  }
+
+  /// @brief Rough per row overhead used when estimating the segment size.
+  static constexpr std::size_t row_overhead{16};
+  /// @brief The most index entries read by one call to `wire_output`.
+  static constexpr std::size_t max_index_read{8192};
+
+  /// @brief The wire log of the segment most recently replayed from.
+  struct wire_reader
+  {
+    int number{-1};
+    std::shared_ptr<const int> wire;
+    std::shared_ptr<const int> index;
+  };
+
   sqlite3* _db_handle{nullptr};
+  sqlite3_stmt* _insert_input{nullptr};
+  sqlite3_stmt* _insert_output{nullptr};
+  std::filesystem::path _filename;
+  segment_policy _policy;
+  std::vector<segment> _segments;
+  int _live{0};
+  std::uintmax_t _live_bytes{0};
+  bool _reader{false};
+  std::chrono::system_clock::time_point _created;
+  int _next_input{1};
+  int _next_output{1};
+  std::shared_ptr<const int> _wire;
+  std::shared_ptr<const int> _index;
+  std::uint64_t _wire_end{0};
+  int _wire_next{1};
+  wire_reader _wire_reader;
+
+  /// @brief Where `read_output` left off.
+  struct cursor
+  {
+    int number{-1};
+    sqlite3* db{nullptr};
+    sqlite3_stmt* stmt{nullptr};
+    int next{0};
+  };
+  cursor _cursor;
 };
 } // namespace fixme
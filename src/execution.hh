@@ -0,0 +1,365 @@
+// soupstock - a soupbintcp library
+//
+// Copyright 2025 Krister Joas
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <asio.hpp>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <fmt/chrono.h>
+#include <fmt/format.h>
+#include <pthread.h>
+#include <sched.h>
+#include <span>
+#include <spdlog/spdlog.h>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <thread>
+#include <vector>
+
+using namespace std::literals;
+
+namespace fixme::soupstock
+{
+/// @brief Options applied to every accepted and connected socket.
+struct socket_options
+{
+  /// @brief Disable Nagle's algorithm (TCP_NODELAY).
+  bool no_delay{true};
+  /// @brief SO_SNDBUF in bytes. Zero keeps the system default.
+  int send_buffer{0};
+  /// @brief SO_RCVBUF in bytes. Zero keeps the system default.
+  int receive_buffer{0};
+  /// @brief SO_BUSY_POLL in microseconds. Zero disables busy polling in the
+  /// kernel.
+  int busy_poll{0};
+};
+
+/// @brief Applies the socket options to a connected socket.
+///
+/// Failures are logged but otherwise ignored so that a missing capability,
+/// e.g. SO_BUSY_POLL without CAP_NET_ADMIN, doesn't take the session down.
+inline void apply_socket_options(asio::ip::tcp::socket& socket, const socket_options& options)
+{
+  asio::error_code ec;
+  socket.set_option(asio::ip::tcp::no_delay(options.no_delay), ec);
+  if(ec)
+    spdlog::warn("TCP_NODELAY: {}", ec.message());
+  if(options.send_buffer > 0)
+  {
+    socket.set_option(asio::socket_base::send_buffer_size(options.send_buffer), ec);
+    if(ec)
+      spdlog::warn("SO_SNDBUF: {}", ec.message());
+  }
+  if(options.receive_buffer > 0)
+  {
+    socket.set_option(asio::socket_base::receive_buffer_size(options.receive_buffer), ec);
+    if(ec)
+      spdlog::warn("SO_RCVBUF: {}", ec.message());
+  }
+  if(options.busy_poll > 0)
+  {
+#ifdef SO_BUSY_POLL
+    int value = options.busy_poll;
+    if(::setsockopt(socket.native_handle(), SOL_SOCKET, SO_BUSY_POLL, &value, sizeof(value)) != 0)
+      spdlog::warn("SO_BUSY_POLL: {}", std::strerror(errno));
+#else
+    spdlog::warn("SO_BUSY_POLL: not supported on this platform");
+#endif
+  }
+}
+
+/// @brief How the io_context is driven.
+struct execution_config
+{
+  /// @brief Drive the io_context from a `poll()` spin loop instead of
+  /// blocking in `run()`.
+  bool busy_poll{false};
+  /// @brief Core to pin the io_context thread to. A negative value leaves the
+  /// thread unpinned.
+  int cpu{-1};
+  /// @brief Lock all current and future pages in memory with `mlockall`.
+  bool lock_memory{false};
+  /// @brief How often the busy poll loop logs its statistics.
+  std::chrono::seconds report_interval{10s};
+  /// @brief How often the wake-up probe fires. Zero disables it. The probe is
+  /// a pending timer, so `run()` doesn't return for lack of work while it is
+  /// enabled.
+  std::chrono::milliseconds probe_interval{0};
+};
+
+/// @brief Statistics collected by the busy poll loop.
+///
+/// The poll gap is the time between the start of the previous `poll()` and the
+/// start of a `poll()` which ran handlers, i.e. the length of the previous
+/// iteration of the loop. An event which became ready during that iteration
+/// waited at most this long. It is not the time from readiness to handling,
+/// which `poll()` can't observe.
+///
+/// The wake-up latency is measured by a probe in both modes: a timer fires
+/// every `probe_interval` and records how long after its expiry the handler
+/// ran, i.e. how long a ready event waited for the loop.
+struct busy_poll_stats
+{
+  std::uint64_t polls{};
+  std::uint64_t idle_spins{};
+  std::uint64_t handlers{};
+  std::chrono::nanoseconds idle_time{};
+  std::chrono::nanoseconds gap_total{};
+  std::chrono::nanoseconds gap_max{};
+  std::uint64_t gaps{};
+  std::chrono::nanoseconds wakeup_total{};
+  std::chrono::nanoseconds wakeup_max{};
+  std::uint64_t wakeups{};
+};
+
+/// @brief Runs an io_context according to an execution_config.
+///
+/// In the default mode the context is run with `run()` on a dedicated thread.
+/// In busy poll mode the thread never sleeps in epoll but spins on `poll()`.
+/// In both cases the thread is pinned to the configured core.
+class runner
+{
+public:
+  runner(asio::io_context& context, execution_config config)
+    : _context(context),
+      _config(std::move(config)),
+      _probe(context)
+  {}
+
+  /// @brief Runs the io_context and blocks until it stops.
+  ///
+  /// The thread pins itself before it runs any handler, so the loop never
+  /// starts on the wrong core.
+  void run()
+  {
+    if(_config.lock_memory && ::mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+      throw std::runtime_error(fmt::format("mlockall: {}", std::strerror(errno)));
+    if(_config.probe_interval > 0ms)
+      probe();
+    std::thread thread([this] {
+      pin();
+      if(_config.busy_poll)
+        spin();
+      else
+        _context.run();
+    });
+    thread.join();
+    if(_config.busy_poll)
+      report();
+  }
+
+  /// @brief Asks the busy poll loop to exit. Safe to call from any thread.
+  void stop()
+  {
+    _stop.store(true, std::memory_order_relaxed);
+    _context.stop();
+  }
+
+  busy_poll_stats stats() const
+  {
+    busy_poll_stats stats;
+    stats.polls = _polls.load(std::memory_order_relaxed);
+    stats.idle_spins = _idle_spins.load(std::memory_order_relaxed);
+    stats.handlers = _handlers.load(std::memory_order_relaxed);
+    stats.idle_time = std::chrono::nanoseconds(_idle_ns.load(std::memory_order_relaxed));
+    stats.gap_total = std::chrono::nanoseconds(_gap_ns.load(std::memory_order_relaxed));
+    stats.gap_max = std::chrono::nanoseconds(_gap_max_ns.load(std::memory_order_relaxed));
+    stats.gaps = _gaps.load(std::memory_order_relaxed);
+    stats.wakeup_total = std::chrono::nanoseconds(_wakeup_ns.load(std::memory_order_relaxed));
+    stats.wakeup_max = std::chrono::nanoseconds(_wakeup_max_ns.load(std::memory_order_relaxed));
+    stats.wakeups = _wakeups.load(std::memory_order_relaxed);
+    return stats;
+  }
+
+  /// @brief Logs the busy poll statistics.
+  void report() const
+  {
+    auto s = stats();
+    auto idle = s.polls == 0 ? 0.0 : 100.0 * static_cast<double>(s.idle_spins) / static_cast<double>(s.polls);
+    auto average = s.gaps == 0 ? 0ns : s.gap_total / static_cast<std::int64_t>(s.gaps);
+    auto wakeup = s.wakeups == 0 ? 0ns : s.wakeup_total / static_cast<std::int64_t>(s.wakeups);
+    spdlog::info("busy poll: polls {} idle {} ({:.1f}%) handlers {} poll gap avg {} max {} wake-up avg {} max {} "
+                 "idle time {}",
+      s.polls, s.idle_spins, idle, s.handlers, average, s.gap_max, wakeup, s.wakeup_max,
+      std::chrono::duration_cast<std::chrono::milliseconds>(s.idle_time));
+  }
+
+private:
+  /// @brief Pins the calling thread to the configured core.
+  void pin()
+  {
+    if(_config.cpu < 0)
+      return;
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(_config.cpu, &cpus);
+    if(auto ec = ::pthread_setaffinity_np(::pthread_self(), sizeof(cpus), &cpus); ec != 0)
+      spdlog::warn("pin to cpu {}: {}", _config.cpu, std::strerror(ec));
+  }
+
+  /// @brief Arms the wake-up probe. Runs on the io_context thread, the only
+  /// writer of the wake-up statistics.
+  void probe()
+  {
+    _probe.expires_after(_config.probe_interval);
+    _probe.async_wait([this](const asio::error_code& ec) {
+      if(ec)
+        return;
+      auto late = std::chrono::nanoseconds(std::chrono::steady_clock::now() - _probe.expiry()).count();
+      _wakeup_ns.store(_wakeup_ns.load(std::memory_order_relaxed) + late, std::memory_order_relaxed);
+      _wakeup_max_ns.store(std::max(_wakeup_max_ns.load(std::memory_order_relaxed), late), std::memory_order_relaxed);
+      _wakeups.store(_wakeups.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      probe();
+    });
+  }
+
+  /// @brief The busy poll loop. Statistics are kept in locals and published
+  /// with relaxed stores so the loop itself never contends with readers.
+  void spin()
+  {
+    using clock = std::chrono::steady_clock;
+    std::uint64_t polls{};
+    std::uint64_t idle_spins{};
+    std::uint64_t handlers{};
+    std::uint64_t gaps{};
+    clock::duration idle_time{};
+    clock::duration gap_total{};
+    clock::duration gap_max{};
+    auto previous = clock::now();
+    auto next_report = previous + _config.report_interval;
+    while(!_stop.load(std::memory_order_relaxed) && !_context.stopped())
+    {
+      auto start = clock::now();
+      auto count = _context.poll();
+      ++polls;
+      if(count == 0)
+      {
+        ++idle_spins;
+        idle_time += clock::now() - start;
+      }
+      else
+      {
+        handlers += count;
+        ++gaps;
+        auto gap = start - previous;
+        gap_total += gap;
+        gap_max = std::max(gap_max, gap);
+      }
+      previous = start;
+      _polls.store(polls, std::memory_order_relaxed);
+      _idle_spins.store(idle_spins, std::memory_order_relaxed);
+      _handlers.store(handlers, std::memory_order_relaxed);
+      _gaps.store(gaps, std::memory_order_relaxed);
+      _idle_ns.store(std::chrono::nanoseconds(idle_time).count(), std::memory_order_relaxed);
+      _gap_ns.store(std::chrono::nanoseconds(gap_total).count(), std::memory_order_relaxed);
+      _gap_max_ns.store(std::chrono::nanoseconds(gap_max).count(), std::memory_order_relaxed);
+      if(start >= next_report)
+      {
+        report();
+        next_report = start + _config.report_interval;
+      }
+    }
+  }
+
+  asio::io_context& _context;
+  execution_config _config;
+  std::atomic<bool> _stop{false};
+  std::atomic<std::uint64_t> _polls{};
+  std::atomic<std::uint64_t> _idle_spins{};
+  std::atomic<std::uint64_t> _handlers{};
+  std::atomic<std::uint64_t> _gaps{};
+  std::atomic<std::int64_t> _idle_ns{};
+  std::atomic<std::int64_t> _gap_ns{};
+  std::atomic<std::int64_t> _gap_max_ns{};
+  asio::steady_timer _probe;
+  std::atomic<std::int64_t> _wakeup_ns{};
+  std::atomic<std::int64_t> _wakeup_max_ns{};
+  std::atomic<std::uint64_t> _wakeups{};
+};
+
+/// @brief Parses the argument of a command line option as a number. Throws
+/// unless the whole argument is a number of type `T`.
+template<typename T>
+T parse_number(std::string_view option, std::string_view arg)
+{
+  T value{};
+  auto [ptr, ec] = std::from_chars(arg.data(), arg.data() + arg.length(), value);
+  if(ec != std::errc{} || ptr != arg.data() + arg.length())
+    throw std::runtime_error(fmt::format("{}: not a number: {}", option, arg));
+  return value;
+}
+
+/// @brief Parses the argument following the option at `i` as a number and
+/// moves `i` to it.
+template<typename T>
+T parse_number(std::span<const std::string_view> args, std::size_t& i)
+{
+  ++i;
+  return parse_number<T>(args[i - 1], args[i]);
+}
+
+/// @brief Parses the command line options shared by the server and the
+/// client.
+///
+/// - `--busy-poll` drive the io_context from a poll() spin loop
+/// - `--cpu N` pin the io_context thread to core N
+/// - `--mlock` lock all pages in memory
+/// - `--so-busy-poll USEC` set SO_BUSY_POLL on every socket
+/// - `--sndbuf BYTES` and `--rcvbuf BYTES` set the socket buffer sizes
+/// - `--nagle` leave Nagle's algorithm enabled
+/// - `--probe MS` measure the wake-up latency every MS milliseconds
+///
+/// Returns the arguments which weren't recognized.
+inline std::vector<std::string_view> parse_execution_options(
+  int argc, char* argv[], execution_config& config, socket_options& options)
+{
+  std::vector<std::string_view> rest;
+  auto number = [&](int& i) {
+    if(i + 1 >= argc)
+      throw std::runtime_error(fmt::format("{}: missing argument", argv[i]));
+    ++i;
+    return parse_number<int>(argv[i - 1], argv[i]);
+  };
+  for(int i = 1; i < argc; ++i)
+  {
+    std::string_view arg{argv[i]};
+    if(arg == "--busy-poll")
+      config.busy_poll = true;
+    else if(arg == "--cpu")
+      config.cpu = number(i);
+    else if(arg == "--mlock")
+      config.lock_memory = true;
+    else if(arg == "--so-busy-poll")
+      options.busy_poll = number(i);
+    else if(arg == "--sndbuf")
+      options.send_buffer = number(i);
+    else if(arg == "--rcvbuf")
+      options.receive_buffer = number(i);
+    else if(arg == "--nagle")
+      options.no_delay = false;
+    else if(arg == "--probe")
+      config.probe_interval = std::chrono::milliseconds(number(i));
+    else
+      rest.push_back(arg);
+  }
+  return rest;
+}
+} // namespace fixme::soupstock
@@ -0,0 +1,188 @@
+// soupstock - a soupbintcp library
+//
+// Copyright 2025 Krister Joas
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include "database.hh"
+#include "moldudp64.hh"
+
+#include <asio.hpp>
+#include <chrono>
+#include <fmt/format.h>
+#include <span>
+#include <spdlog/spdlog.h>
+#include <string>
+#include <vector>
+
+using namespace std::literals;
+
+namespace fixme::soupstock
+{
+struct publisher_config
+{
+  /// @brief The session name. Messages are stored in `server-{session}.db`,
+  /// which is also where SoupBinTCP sessions with the same name replay from.
+  std::string session;
+  /// @brief A multicast group or a list of unicast receivers.
+  std::vector<asio::ip::udp::endpoint> destinations;
+  /// @brief The largest datagram sent, including the packet header.
+  std::size_t max_datagram{1400};
+  /// @brief Multicast time to live.
+  int hops{1};
+  /// @brief Deliver multicast to receivers on the same host, which is what
+  /// makes the feed testable on loopback.
+  bool loopback{true};
+  segment_policy policy;
+};
+
+/// @brief Publishes a sequenced stream as MoldUDP64 datagrams.
+///
+/// Every message is stored in the same `fixme::database` store that a
+/// SoupBinTCP server session with the same name uses, so receivers recover
+/// gaps by logging in to the server and replaying from the first missing
+/// sequence number.
+///
+/// Messages published from the same handler are packed into as few datagrams
+/// as possible: the packet is flushed when it is full or, at the latest, when
+/// control returns to the io_context. `publish` must be called on the
+/// publisher's executor.
+class mold_publisher
+{
+public:
+  mold_publisher(asio::io_context& context, publisher_config config)
+    : _config(std::move(config)),
+      _socket(context, asio::ip::udp::v4()),
+      _heartbeat(context)
+  {
+    _socket.set_option(asio::ip::multicast::hops(_config.hops));
+    _socket.set_option(asio::ip::multicast::enable_loopback(_config.loopback));
+    _database.open(fmt::format("server-{}.db", _config.session), _config.policy);
+    _next = static_cast<std::uint64_t>(_database.last_output()) + 1;
+    _first = _next;
+    heartbeat();
+  }
+
+  ~mold_publisher() { end_session(); }
+
+  /// @brief Stores and sends a message.
+  void publish(std::string_view msg)
+  {
+    auto sequence = _database.store_output(msg);
+    append(static_cast<std::uint64_t>(sequence), msg);
+  }
+
+  /// @brief Stores a block of messages in one transaction and sends them.
+  void publish(std::span<const std::string_view> msgs)
+  {
+    if(msgs.empty())
+      return;
+    auto sequence = static_cast<std::uint64_t>(_database.store_output(msgs));
+    for(auto msg: msgs)
+      append(sequence++, msg);
+  }
+
+  /// @brief Sends the end of session packet.
+  void end_session()
+  {
+    if(_ended)
+      return;
+    flush();
+    send(_next, moldudp64::end_of_session);
+    _heartbeat.cancel();
+    _ended = true;
+  }
+
+  /// @brief The sequence number of the next message.
+  std::uint64_t next() const { return _next; }
+
+private:
+  void append(std::uint64_t sequence, std::string_view msg)
+  {
+    auto needed = sizeof(std::uint16_t) + msg.size();
+    if(moldudp64::header_length + needed > _config.max_datagram)
+      throw std::runtime_error(fmt::format("{}: message too large for a datagram: {}", _config.session, msg.size()));
+    if(_count > 0 && _packet.size() + needed > _config.max_datagram)
+      flush();
+    if(_count == 0)
+    {
+      _first = sequence;
+      _packet.resize(moldudp64::header_length);
+      asio::post(_socket.get_executor(), [this] { flush(); });
+    }
+    char length[2];
+    moldudp64::put(length, msg.size(), sizeof(length));
+    _packet.append(length, sizeof(length));
+    _packet.append(msg);
+    ++_count;
+    _next = sequence + 1;
+  }
+
+  void flush()
+  {
+    if(_count == 0)
+      return;
+    moldudp64::write_header(_packet, _config.session, _first, _count);
+    for(const auto& destination: _config.destinations)
+    {
+      asio::error_code ec;
+      _socket.send_to(asio::buffer(_packet), destination, 0, ec);
+      if(ec)
+        spdlog::warn("{}: send to {}: {}", _config.session, destination.address().to_string(), ec.message());
+    }
+    _count = 0;
+    _packet.clear();
+    _idle = false;
+  }
+
+  /// @brief Sends a packet without messages.
+  void send(std::uint64_t sequence, std::uint16_t count)
+  {
+    std::string packet;
+    moldudp64::write_header(packet, _config.session, sequence, count);
+    for(const auto& destination: _config.destinations)
+    {
+      asio::error_code ec;
+      _socket.send_to(asio::buffer(packet), destination, 0, ec);
+    }
+  }
+
+  /// @brief Sends a heart beat every second unless data was sent, so that
+  /// receivers notice a gap at the end of the stream.
+  void heartbeat()
+  {
+    _heartbeat.expires_after(1s);
+    _heartbeat.async_wait([this](std::error_code ec) {
+      if(ec || _ended)
+        return;
+      if(_idle)
+        send(_next, 0);
+      _idle = true;
+      heartbeat();
+    });
+  }
+
+  publisher_config _config;
+  asio::ip::udp::socket _socket;
+  asio::steady_timer _heartbeat;
+  database _database;
+  std::string _packet;
+  std::uint64_t _first{1};
+  std::uint64_t _next{1};
+  std::uint16_t _count{0};
+  bool _idle{true};
+  bool _ended{false};
+};
+} // namespace fixme::soupstock
@@ -0,0 +1,363 @@
+// soupstock - a soupbintcp library
+//
+// Copyright 2025 Krister Joas
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include "base_session.hh"
+#include "client_session.hh"
+#include "database.hh"
+#include "execution.hh"
+#include "moldudp64.hh"
+#include "util.hh"
+
+#include <asio.hpp>
+#include <charconv>
+#include <chrono>
+#include <fmt/chrono.h>
+#include <functional>
+#include <map>
+#include <spdlog/spdlog.h>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+using namespace std::literals;
+
+namespace fixme::soupstock
+{
+struct feed_config
+{
+  /// @brief The multicast group, or the local address for unicast.
+  std::string address;
+  unsigned short port;
+  /// @brief The local interface used to join the group.
+  std::string interface{"0.0.0.0"};
+  /// @brief The SoupBinTCP server used to recover gaps and the credentials
+  /// for it. The session name is also the MoldUDP64 session name.
+  session_config recovery;
+  /// @brief The most messages kept ahead of a gap. Further messages are
+  /// dropped and left to the recovery session, which replays everything up to
+  /// the newest sequence number seen.
+  std::size_t max_pending{65536};
+};
+
+/// @brief A SoupBinTCP session which replays a range of a stream on behalf of
+/// a MoldUDP64 receiver.
+///
+/// The session logs in asking for the first missing sequence number and
+/// passes every sequenced message to the receiver, which logs out once the gap
+/// is filled. If the server no longer has the first messages asked for, the
+/// receiver is told where the replay starts instead.
+class recovery_session: public base_session
+{
+public:
+  recovery_session(asio::io_context& context, const session_config& config, std::uint64_t sequence,
+    std::function<void(std::uint64_t, std::string_view)> deliver, std::function<void(std::uint64_t)> unavailable)
+    : base_session(asio::ip::tcp::socket{context}, config.session),
+      _config(config),
+      _resolver(context),
+      _deliver(std::move(deliver)),
+      _unavailable(std::move(unavailable))
+  {
+    _sequence = static_cast<int>(sequence);
+  }
+
+  /// @brief Connects and logs in. Throws if the server can't be reached,
+  /// before anything has been queued.
+  void start()
+  {
+    auto msg =
+      fmt::format("{:<6s}{:<10s}{:<10s}{:<20d}", _config.username, _config.password, _session_name, _sequence);
+    asio::connect(_socket, _resolver.resolve(_config.host, _config.port));
+    apply_socket_options(_socket, _config.options);
+    dispatch('L', msg);
+    run();
+  }
+
+  void logout() { dispatch('O'); }
+
+private:
+  void process_message(std::string_view msg) override
+  {
+    if(msg.empty())
+      throw std::runtime_error("empty message");
+    switch(msg[0])
+    {
+      case 'J':
+        spdlog::info("{}: recovery rejected {}", _session_name, msg.substr(1, 1));
+        stop();
+        break;
+      case 'A':
+        process_accept(trim(msg.substr(11, 20)));
+        break;
+      case 'S':
+        _deliver(static_cast<std::uint64_t>(_sequence++), msg.substr(1));
+        break;
+      case 'H':
+        _timeout.expires_after(15s);
+        break;
+      default:
+        break;
+    }
+  }
+
+  /// @brief Numbers the replay from the sequence number in the accept.
+  void process_accept(std::string_view accepted)
+  {
+    int next{};
+    auto [ptr, ec] = std::from_chars(accepted.data(), accepted.data() + accepted.length(), next);
+    if(ec != std::errc{} || next <= _sequence)
+      return;
+    _unavailable(static_cast<std::uint64_t>(next));
+    _sequence = next;
+  }
+
+  void timer_handler() override { dispatch('R'); }
+
+  session_config _config;
+  asio::ip::tcp::resolver _resolver;
+  std::function<void(std::uint64_t, std::string_view)> _deliver;
+  std::function<void(std::uint64_t)> _unavailable;
+};
+
+/// @brief Receives a MoldUDP64 feed and fills gaps over SoupBinTCP.
+///
+/// Messages are delivered to the handler strictly in sequence order and
+/// stored in the same `client-{user}-{session}.db` store as `client_session`
+/// uses, so a restarted receiver continues where it left off. Messages which
+/// arrive ahead of a gap are kept, up to `max_pending`, until the gap has been
+/// filled by a recovery session. If the recovery server can't be reached the
+/// feed keeps being received while the recovery is retried with a backoff.
+template<typename Handler>
+class mold_receiver: public std::enable_shared_from_this<mold_receiver<Handler>>
+{
+  // Messages are delivered from the feed reader and from recovery sessions as
+  // they arrive, so there is nothing to suspend.
+  static_assert(!is_awaitable<decltype(std::declval<Handler&>().process_sequenced(
+                  std::declval<mold_receiver&>(), std::string_view{}))>::value,
+    "mold_receiver needs a handler whose process_sequenced is synchronous");
+
+public:
+  mold_receiver(asio::io_context& context, feed_config config)
+    : _context(context),
+      _config(std::move(config)),
+      _socket(context),
+      _retry(context),
+      _handler(std::make_unique<Handler>())
+  {}
+
+  const std::string& name() const { return _config.recovery.session; }
+  int sequence() const { return static_cast<int>(_sequence); }
+
+  /// @brief The number of messages received more than once, e.g. on the feed
+  /// and in a recovery session.
+  std::uint64_t duplicates() const { return _duplicates; }
+
+  void run()
+  {
+    _database.open(fmt::format("client-{}-{}.db", _config.recovery.username, name()));
+    _sequence = static_cast<std::uint64_t>(_database.last_input()) + 1;
+    auto address = asio::ip::make_address(_config.address);
+    auto local = address.is_multicast() ? asio::ip::address(asio::ip::address_v4::any()) : address;
+    asio::ip::udp::endpoint endpoint(local, _config.port);
+    _socket.open(endpoint.protocol());
+    _socket.set_option(asio::ip::udp::socket::reuse_address(true));
+    _socket.bind(endpoint);
+    if(address.is_multicast())
+      _socket.set_option(
+        asio::ip::multicast::join_group(address.to_v4(), asio::ip::make_address_v4(_config.interface)));
+    auto self = this->shared_from_this();
+    asio::co_spawn(_socket.get_executor(), [self] { return self->reader(); }, asio::detached);
+  }
+
+  void close()
+  {
+    std::error_code ec;
+    _socket.close(ec);
+    _retry.cancel();
+    if(auto recovery = _recovery.lock())
+      recovery->logout();
+  }
+
+private:
+  asio::awaitable<void> reader()
+  {
+    try
+    {
+      std::vector<char> packet(65536);
+      while(_socket.is_open())
+      {
+        auto length = co_await _socket.async_receive(asio::buffer(packet), asio::use_awaitable);
+        process_packet(std::span<const char>(packet.data(), length));
+      }
+    }
+    catch(const std::exception& ex)
+    {
+      spdlog::info("{}: feed closed: {}", name(), ex.what());
+    }
+  }
+
+  void process_packet(std::span<const char> packet)
+  {
+    auto header = moldudp64::read_header(packet);
+    if(!header || trim(header->session) != name())
+      return;
+    if(header->count == moldudp64::end_of_session)
+    {
+      spdlog::info("{}: end of session at ({})", name(), header->sequence);
+      detect_gap(header->sequence);
+      return;
+    }
+    // A heart beat carries the next sequence number, so anything before it
+    // which hasn't been seen is missing.
+    if(header->count == 0)
+      return detect_gap(header->sequence);
+    auto sequence = header->sequence;
+    std::size_t offset{moldudp64::header_length};
+    for(std::uint16_t i = 0; i < header->count; ++i, ++sequence)
+    {
+      if(offset + 2 > packet.size())
+        return;
+      auto length = moldudp64::get(packet.data() + offset, 2);
+      offset += 2;
+      if(offset + length > packet.size())
+        return;
+      received(sequence, std::string_view(packet.data() + offset, length));
+      offset += length;
+    }
+  }
+
+  /// @brief Handles a message from either the feed or a recovery session.
+  void received(std::uint64_t sequence, std::string_view msg)
+  {
+    if(sequence < _sequence || _pending.contains(sequence))
+    {
+      ++_duplicates;
+      return;
+    }
+    if(sequence > _sequence)
+    {
+      if(_pending.size() < _config.max_pending)
+        _pending.try_emplace(sequence, msg);
+      else if(!std::exchange(_pending_full, true))
+        spdlog::warn("{}: {} messages pending, leaving the rest to recovery", name(), _pending.size());
+      detect_gap(sequence);
+      return;
+    }
+    deliver(msg);
+    deliver_pending();
+  }
+
+  /// @brief Gives up on messages which the server no longer has.
+  void unavailable(std::uint64_t next)
+  {
+    if(next <= _sequence)
+      return;
+    spdlog::warn("{}: ({}-{}) no longer available", name(), _sequence, next - 1);
+    _database.skip_input(static_cast<int>(next));
+    _sequence = next;
+    _pending.erase(_pending.begin(), _pending.lower_bound(next));
+    deliver_pending();
+  }
+
+  /// @brief Delivers the messages kept while waiting for a gap to be filled
+  /// and ends the recovery once it is.
+  void deliver_pending()
+  {
+    while(!_pending.empty() && _pending.begin()->first == _sequence)
+    {
+      deliver(_pending.begin()->second);
+      _pending.erase(_pending.begin());
+    }
+    if(auto recovery = _recovery.lock(); recovery && _sequence >= _recover_to)
+    {
+      spdlog::info("{}: gap filled up to ({})", name(), _sequence - 1);
+      recovery->logout();
+      _recovery.reset();
+      _backoff = min_backoff;
+      _pending_full = false;
+    }
+  }
+
+  void deliver(std::string_view msg)
+  {
+    _database.store_input(msg);
+    _handler->process_sequenced(*this, msg);
+    ++_sequence;
+  }
+
+  /// @brief Starts a recovery session if messages before `next` are missing.
+  void detect_gap(std::uint64_t next)
+  {
+    if(next <= _sequence)
+      return;
+    _recover_to = std::max(_recover_to, next);
+    if(!_recovery.expired() || _retrying)
+      return;
+    spdlog::info("{}: gap ({}-{}), recovering", name(), _sequence, next - 1);
+    auto self = this->shared_from_this();
+    auto recovery = std::make_shared<recovery_session>(_context, _config.recovery, _sequence,
+      [self](std::uint64_t sequence, std::string_view msg) { self->received(sequence, msg); },
+      [self](std::uint64_t next) { self->unavailable(next); });
+    _recovery = recovery;
+    try
+    {
+      recovery->start();
+    }
+    catch(const std::exception& ex)
+    {
+      _recovery.reset();
+      retry(ex.what());
+    }
+  }
+
+  /// @brief Starts another recovery session after a backoff which doubles up
+  /// to `max_backoff`.
+  void retry(std::string_view reason)
+  {
+    spdlog::warn("{}: recovery failed: {}, retrying in {}", name(), reason, _backoff);
+    _retrying = true;
+    _retry.expires_after(_backoff);
+    _backoff = std::min(_backoff * 2, max_backoff);
+    auto self = this->shared_from_this();
+    _retry.async_wait(
+      [self](const std::error_code& ec)
+      {
+        self->_retrying = false;
+        if(!ec && self->_socket.is_open())
+          self->detect_gap(self->_recover_to);
+      });
+  }
+
+  static constexpr std::chrono::milliseconds min_backoff{100ms};
+  static constexpr std::chrono::milliseconds max_backoff{5s};
+
+  asio::io_context& _context;
+  feed_config _config;
+  asio::ip::udp::socket _socket;
+  asio::steady_timer _retry;
+  std::chrono::milliseconds _backoff{min_backoff};
+  bool _retrying{false};
+  bool _pending_full{false};
+  std::unique_ptr<Handler> _handler;
+  database _database;
+  std::uint64_t _sequence{1};
+  std::uint64_t _recover_to{0};
+  std::uint64_t _duplicates{0};
+  std::map<std::uint64_t, std::string> _pending;
+  std::weak_ptr<recovery_session> _recovery;
+};
+} // namespace fixme::soupstock
@@ -0,0 +1,78 @@
+// soupstock - a soupbintcp library
+//
+// Copyright 2025 Krister Joas
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstdint>
+#include <fmt/format.h>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+
+namespace fixme::soupstock::moldudp64
+{
+/// @brief MoldUDP64 packet layout.
+///
+/// A packet starts with a 20 byte header: the session name padded with spaces
+/// to 10 bytes, the big endian sequence number of the first message and the
+/// big endian message count. The header is followed by the messages, each
+/// preceded by a big endian two byte length. A count of zero is a heart beat
+/// and 0xffff marks the end of the session.
+constexpr std::size_t session_length{10};
+constexpr std::size_t header_length{20};
+constexpr std::uint16_t end_of_session{0xffff};
+
+struct header
+{
+  std::string_view session;
+  std::uint64_t sequence;
+  std::uint16_t count;
+};
+
+inline void put(char* out, std::uint64_t value, std::size_t bytes)
+{
+  for(std::size_t i = 0; i < bytes; ++i)
+    out[i] = static_cast<char>(value >> (8 * (bytes - i - 1)));
+}
+
+inline std::uint64_t get(const char* in, std::size_t bytes)
+{
+  std::uint64_t value{};
+  for(std::size_t i = 0; i < bytes; ++i)
+    value = (value << 8) | static_cast<unsigned char>(in[i]);
+  return value;
+}
+
+/// @brief Writes a packet header to the first `header_length` bytes of
+/// `packet`.
+inline void write_header(std::string& packet, std::string_view session, std::uint64_t sequence, std::uint16_t count)
+{
+  packet.resize(std::max(packet.size(), header_length));
+  auto name = fmt::format("{:<10.10s}", session);
+  packet.replace(0, session_length, name);
+  put(packet.data() + session_length, sequence, 8);
+  put(packet.data() + session_length + 8, count, 2);
+}
+
+inline std::optional<header> read_header(std::span<const char> packet)
+{
+  if(packet.size() < header_length)
+    return std::nullopt;
+  return header{std::string_view(packet.data(), session_length), get(packet.data() + session_length, 8),
+    static_cast<std::uint16_t>(get(packet.data() + session_length + 8, 2))};
+}
+} // namespace fixme::soupstock::moldudp64
@@ -0,0 +1,104 @@
+// soupstock - a soupbintcp library
+//
+// Copyright 2025 Krister Joas
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <atomic>
+#include <optional>
+#include <utility>
+
+namespace fixme
+{
+/// @brief An unbounded multiple producer, single consumer queue.
+///
+/// This is Dmitry Vyukov's intrusive node based queue. `push` may be called
+/// from any thread and costs one node allocation and one atomic exchange; it
+/// never waits for other producers or the consumer. `pop` and `empty` may
+/// only be called by one thread at a time.
+///
+/// A producer which has swapped in its node but not yet linked it makes the
+/// queue look empty to the consumer until the link is stored, so a consumer
+/// must not rely on `empty` alone to decide that no more work will come.
+template<typename T>
+class mpsc_queue
+{
+public:
+  mpsc_queue() = default;
+  mpsc_queue(const mpsc_queue&) = delete;
+  mpsc_queue& operator=(const mpsc_queue&) = delete;
+
+  ~mpsc_queue()
+  {
+    while(pop())
+      ;
+  }
+
+  void push(T value)
+  {
+    auto* n = new node{std::move(value)};
+    link(n);
+  }
+
+  std::optional<T> pop()
+  {
+    auto* tail = _tail;
+    auto* next = tail->next.load(std::memory_order_acquire);
+    if(tail == &_stub)
+    {
+      if(next == nullptr)
+        return std::nullopt;
+      _tail = next;
+      tail = next;
+      next = next->next.load(std::memory_order_acquire);
+    }
+    if(next == nullptr)
+    {
+      // The tail is the last node. Put the stub behind it so that the tail
+      // can be taken without racing with producers.
+      if(tail != _head.load(std::memory_order_acquire))
+        return std::nullopt;
+      _stub.next.store(nullptr, std::memory_order_relaxed);
+      link(&_stub);
+      next = tail->next.load(std::memory_order_acquire);
+      if(next == nullptr)
+        return std::nullopt;
+    }
+    _tail = next;
+    std::optional<T> value{std::move(tail->value)};
+    delete tail;
+    return value;
+  }
+
+  bool empty() const { return _tail == &_stub && _stub.next.load(std::memory_order_acquire) == nullptr; }
+
+private:
+  struct node
+  {
+    T value{};
+    std::atomic<node*> next{nullptr};
+  };
+
+  void link(node* n)
+  {
+    auto* previous = _head.exchange(n, std::memory_order_acq_rel);
+    previous->next.store(n, std::memory_order_release);
+  }
+
+  node _stub;
+  alignas(64) std::atomic<node*> _head{&_stub};
+  alignas(64) node* _tail{&_stub};
+};
+} // namespace fixme
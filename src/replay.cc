@@ -0,0 +1,262 @@
+// soupstock - a soupbintcp library
+//
+// Copyright 2025 Krister Joas
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Feeds the inbound packets of one captured connection back into a session.
+//
+//   replay FILE [--connection N] [--client] [--paced] [--pipeline N] [--verbose]
+//
+// By default the packets are sent to a `server_session`, i.e. the capture was
+// made with `server --capture`. With `--client` they are sent to a
+// `client_session`, i.e. the capture was made with `client --capture`. The
+// session talks to a fake counterparty over a loopback connection which
+// writes the captured packets as fast as possible or, with `--paced`, at the
+// original pacing. Message stores are created in a scratch directory which is
+// removed afterwards, so every run starts from the same state.
+
+#include "capture.hh"
+#include "client_handler.hh"
+#include "client_session.hh"
+#include "execution.hh"
+#include "server_handler.hh"
+#include "server_session.hh"
+#include "util.hh"
+
+#include <array>
+#include <filesystem>
+#include <spdlog/spdlog.h>
+#include <unistd.h>
+#include <vector>
+
+namespace fixme::soupstock
+{
+/// @brief Accepts every login. Replication is never replayed.
+class replay_authenticator
+{
+public:
+  bool authenticate(std::string_view, std::string_view, std::string_view) { return true; }
+  bool authenticate_replica(std::string_view, std::string_view, std::string_view) { return false; }
+  bool feed(std::string_view) { return false; }
+};
+
+/// @brief The result of a replay.
+struct replay_result
+{
+  std::size_t frames_sent{0};
+  std::size_t bytes_sent{0};
+  std::size_t frames_received{0};
+  std::chrono::steady_clock::duration elapsed{};
+};
+
+/// @brief The counterparty of the session under test.
+///
+/// Writes the captured frames to the socket, at the original pacing if
+/// `paced` is set, then shuts down the sending side. Everything the session
+/// sends back is read and counted until the session closes the connection.
+class fake_peer
+{
+public:
+  fake_peer(asio::ip::tcp::socket socket, const std::vector<capture_reader::record>& records, bool paced)
+    : _socket(std::move(socket)),
+      _records(records),
+      _paced(paced)
+  {}
+
+  void run(replay_result& result)
+  {
+    asio::co_spawn(_socket.get_executor(), writer(result), asio::detached);
+    asio::co_spawn(_socket.get_executor(), reader(result), asio::detached);
+  }
+
+private:
+  asio::awaitable<void> writer(replay_result& result)
+  {
+    try
+    {
+      asio::steady_timer timer(_socket.get_executor());
+      auto start = std::chrono::steady_clock::now();
+      for(const auto& r: _records)
+      {
+        if(_paced)
+        {
+          timer.expires_at(start + (r.timestamp - _records.front().timestamp));
+          co_await timer.async_wait(asio::use_awaitable);
+        }
+        auto length = htons(static_cast<std::uint16_t>(r.frame.size()));
+        std::array<asio::const_buffer, 2> buffers{asio::buffer(&length, sizeof(length)), asio::buffer(r.frame)};
+        result.bytes_sent += co_await asio::async_write(_socket, buffers, asio::use_awaitable);
+        ++result.frames_sent;
+      }
+      _socket.shutdown(asio::ip::tcp::socket::shutdown_send);
+    }
+    catch(const std::exception& ex)
+    {
+      spdlog::warn("replay: write: {}", ex.what());
+    }
+  }
+
+  asio::awaitable<void> reader(replay_result& result)
+  {
+    auto start = std::chrono::steady_clock::now();
+    try
+    {
+      std::string msg;
+      while(true)
+      {
+        std::uint16_t length;
+        co_await asio::async_read(_socket, asio::buffer(&length, sizeof(length)), asio::use_awaitable);
+        msg.clear();
+        co_await asio::async_read(_socket, asio::dynamic_buffer(msg, ntohs(length)), asio::use_awaitable);
+        ++result.frames_received;
+      }
+    }
+    catch(const std::exception&)
+    {
+      // The session closed the connection.
+    }
+    result.elapsed = std::chrono::steady_clock::now() - start;
+  }
+
+  asio::ip::tcp::socket _socket;
+  const std::vector<capture_reader::record>& _records;
+  bool _paced;
+};
+
+/// @brief Reads the frames of one connection in one direction. If
+/// `connection` is zero the first connection in the file is used.
+std::vector<capture_reader::record> load_capture(const std::filesystem::path& filename, std::uint32_t& connection,
+  capture::direction direction)
+{
+  capture_reader reader(filename);
+  std::vector<capture_reader::record> records;
+  while(auto r = reader.next())
+  {
+    if(connection == 0)
+      connection = r->connection;
+    if(r->connection == connection && r->direction == direction)
+      records.push_back(std::move(*r));
+  }
+  return records;
+}
+
+/// @brief Replays client packets into a server session.
+replay_result replay_server(const std::filesystem::path& filename, std::uint32_t connection, bool paced,
+  std::size_t max_in_flight)
+{
+  auto records = load_capture(filename, connection, capture::direction::in);
+  replay_result result;
+  asio::io_context context{1};
+  asio::ip::tcp::acceptor acceptor(context, asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+  asio::ip::tcp::socket client(context);
+  client.connect(acceptor.local_endpoint());
+  auto session = std::make_shared<server_session<server_handler, replay_authenticator>>(
+    acceptor.accept(), std::make_shared<replay_authenticator>(), nullptr);
+  acceptor.close();
+  session->set_pipeline(max_in_flight);
+  session->run();
+  fake_peer peer(std::move(client), records, paced);
+  peer.run(result);
+  context.run();
+  return result;
+}
+
+/// @brief Replays server packets into a client session. The credentials are
+/// taken from the captured login request.
+replay_result replay_client(const std::filesystem::path& filename, std::uint32_t connection, bool paced,
+  std::size_t max_in_flight)
+{
+  auto records = load_capture(filename, connection, capture::direction::in);
+  auto sent = load_capture(filename, connection, capture::direction::out);
+  auto login = std::ranges::find_if(sent, [](const auto& r) { return r.frame.starts_with('L'); });
+  if(login == sent.end() || login->frame.size() < 27)
+    throw std::runtime_error(fmt::format("replay: no login request in connection {}", connection));
+  std::string_view msg(login->frame);
+  replay_result result;
+  asio::io_context context{1};
+  asio::ip::tcp::acceptor acceptor(context, asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+  session_config config{"127.0.0.1", std::to_string(acceptor.local_endpoint().port()),
+    std::string(trim(msg.substr(1, 6))), std::string(trim(msg.substr(7, 10))), std::string(trim(msg.substr(17, 10)))};
+  config.max_in_flight = max_in_flight;
+  auto session = std::make_shared<client_session<client_handler>>(context, config);
+  session->run();
+  session->send_login();
+  fake_peer peer(acceptor.accept(), records, paced);
+  acceptor.close();
+  peer.run(result);
+  context.run();
+  return result;
+}
+} // namespace fixme::soupstock
+
+int main(int argc, char* argv[])
+{
+  if(argc < 2)
+  {
+    fmt::print(stderr, "usage: {} FILE [--connection N] [--client] [--paced] [--pipeline N] [--verbose]\n", argv[0]);
+    return 1;
+  }
+  try
+  {
+    auto filename = std::filesystem::absolute(argv[1]);
+    std::uint32_t connection{0};
+    bool client{false};
+    bool paced{false};
+    std::size_t max_in_flight{0};
+    spdlog::set_level(spdlog::level::warn);
+    for(int i = 2; i < argc; ++i)
+    {
+      std::string_view arg(argv[i]);
+      if(arg == "--connection" && i + 1 < argc)
+        connection = fixme::soupstock::parse_number<std::uint32_t>(arg, argv[++i]);
+      else if(arg == "--client")
+        client = true;
+      else if(arg == "--paced")
+        paced = true;
+      else if(arg == "--pipeline" && i + 1 < argc)
+        max_in_flight = fixme::soupstock::parse_number<std::size_t>(arg, argv[++i]);
+      else if(arg == "--verbose")
+        spdlog::set_level(spdlog::level::info);
+      else
+        spdlog::warn("unknown argument: {}", arg);
+    }
+    auto scratch = std::filesystem::temp_directory_path() / fmt::format("soupstock-replay-{}", ::getpid());
+    std::filesystem::create_directories(scratch);
+    auto cwd = std::filesystem::current_path();
+    std::filesystem::current_path(scratch);
+    fixme::soupstock::replay_result result;
+    try
+    {
+      result = client ? fixme::soupstock::replay_client(filename, connection, paced, max_in_flight)
+                      : fixme::soupstock::replay_server(filename, connection, paced, max_in_flight);
+    }
+    catch(...)
+    {
+      std::filesystem::current_path(cwd);
+      std::filesystem::remove_all(scratch);
+      throw;
+    }
+    std::filesystem::current_path(cwd);
+    std::filesystem::remove_all(scratch);
+    auto seconds = std::chrono::duration<double>(result.elapsed).count();
+    fmt::print("sent {} frames, {} bytes; received {} frames; {:.3f} s; {:.0f} frames/s\n", result.frames_sent,
+      result.bytes_sent, result.frames_received, seconds, seconds > 0 ? result.frames_sent / seconds : 0.0);
+  }
+  catch(const std::exception& ex)
+  {
+    spdlog::error("replay: {}", ex.what());
+    return 1;
+  }
+  return 0;
+}
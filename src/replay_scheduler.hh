@@ -0,0 +1,158 @@
+// soupstock - a soupbintcp library
+//
+// Copyright 2025 Krister Joas
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <asio.hpp>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <utility>
+#include <vector>
+
+using namespace std::literals;
+
+namespace fixme::soupstock
+{
+struct replay_config
+{
+  /// @brief How often read budgets are handed out.
+  std::chrono::steady_clock::duration tick{1ms};
+  /// @brief Bytes added to a session's deficit every round.
+  std::size_t quantum{64 * 1024};
+  /// @brief Bytes replayed per tick across all sessions. The rest of the
+  /// tick is left to live traffic.
+  std::size_t budget{1024 * 1024};
+  /// @brief A session reads nothing while this many data frames wait to be
+  /// sent.
+  std::size_t max_queue{1024};
+};
+
+/// @brief Shares disk reads and outbound bytes between sessions which replay
+/// at the same time, e.g. when every client reconnects after a restart.
+///
+/// Replays are served with deficit round robin. Every tick each replay is
+/// credited `quantum` bytes times its weight and may read and queue as much
+/// as its credit allows, bounded by `budget` for the tick as a whole. A
+/// replay which overshoots its credit, because messages are never split,
+/// pays it back in the next round. Sessions which aren't replaying are not
+/// scheduled at all, so live traffic only competes with the bounded replay
+/// share.
+class replay_scheduler: public std::enable_shared_from_this<replay_scheduler>
+{
+public:
+  /// @brief Reads and queues at most about `allowance` bytes of a replay.
+  /// Returns the number of bytes queued or `std::nullopt` when the replay is
+  /// complete. Called on the executor given to `add`.
+  using step = std::function<std::optional<std::size_t>(std::size_t allowance)>;
+
+  replay_scheduler(asio::io_context& context, replay_config config = {})
+    : _config(config),
+      _strand(asio::make_strand(context)),
+      _timer(_strand)
+  {}
+
+  const replay_config& config() const { return _config; }
+
+  /// @brief Schedules a replay until its step function reports completion.
+  void add(asio::any_io_executor executor, step fn, std::size_t weight = 1)
+  {
+    auto self = shared_from_this();
+    asio::post(_strand, [self, executor = std::move(executor), fn = std::move(fn), weight]() mutable {
+      self->_entries.push_back(entry{++self->_next_id, std::move(executor), std::move(fn), weight});
+      if(!std::exchange(self->_running, true))
+        asio::co_spawn(self->_strand, [self] { return self->run(); }, asio::detached);
+    });
+  }
+
+private:
+  struct entry
+  {
+    std::uint64_t id;
+    asio::any_io_executor executor;
+    step fn;
+    std::size_t weight;
+    std::int64_t deficit{0};
+    bool busy{false};
+  };
+
+  /// @brief Ticks until no replays are left. A replay added while the last
+  /// tick's timer is pending is picked up by the same coroutine, since
+  /// `_running` is only cleared here.
+  asio::awaitable<void> run()
+  {
+    while(!_entries.empty())
+    {
+      tick();
+      _timer.expires_after(_config.tick);
+      asio::error_code ec;
+      co_await _timer.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+    }
+    _running = false;
+  }
+
+  /// @brief Hands out one round of credit, starting with a different replay
+  /// every tick.
+  void tick()
+  {
+    auto budget = static_cast<std::int64_t>(_config.budget);
+    auto count = _entries.size();
+    for(std::size_t n = 0; n < count && budget > 0; ++n)
+    {
+      auto& e = _entries[(_next + n) % count];
+      if(e.busy)
+        continue;
+      e.deficit += static_cast<std::int64_t>(_config.quantum * e.weight);
+      if(e.deficit <= 0)
+        continue;
+      auto allowance = std::min(e.deficit, budget);
+      budget -= allowance;
+      e.busy = true;
+      auto self = shared_from_this();
+      asio::post(e.executor, [self, id = e.id, fn = e.fn, allowance] {
+        auto used = fn(static_cast<std::size_t>(allowance));
+        asio::post(self->_strand, [self, id, used] { self->finished(id, used); });
+      });
+    }
+    _next = count == 0 ? 0 : (_next + 1) % count;
+  }
+
+  void finished(std::uint64_t id, std::optional<std::size_t> used)
+  {
+    auto e = std::ranges::find(_entries, id, &entry::id);
+    if(e == _entries.end())
+      return;
+    if(!used)
+    {
+      _entries.erase(e);
+      return;
+    }
+    e->busy = false;
+    // A replay with nothing to send doesn't bank credit.
+    e->deficit = *used == 0 ? 0 : e->deficit - static_cast<std::int64_t>(*used);
+  }
+
+  replay_config _config;
+  asio::strand<asio::io_context::executor_type> _strand;
+  asio::steady_timer _timer;
+  std::vector<entry> _entries;
+  std::size_t _next{0};
+  std::uint64_t _next_id{0};
+  bool _running{false};
+};
+} // namespace fixme::soupstock
@@ -0,0 +1,174 @@
+// soupstock - a soupbintcp library
+//
+// Copyright 2025 Krister Joas
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include "base_session.hh"
+#include "client_session.hh"
+#include "database.hh"
+#include "execution.hh"
+#include "util.hh"
+
+#include <asio.hpp>
+#include <charconv>
+#include <chrono>
+#include <fmt/chrono.h>
+#include <fmt/format.h>
+#include <fmt/ranges.h>
+#include <functional>
+#include <spdlog/spdlog.h>
+
+using namespace std::literals;
+
+namespace fixme::soupstock
+{
+/// @brief A standby server's session to a primary server.
+///
+/// The session logs in with replication credentials and tails the output
+/// store of one session on the primary, writing each message to the local
+/// `server-{name}.db` with the sequence number assigned by the primary. When
+/// the standby takes over its stores are current and clients replay from them
+/// as usual.
+///
+/// The primary sends the highest sequence number in its store with every heart
+/// beat, which is used to compute the replication lag.
+class replica_session: public base_session
+{
+public:
+  /// @brief Called when the session ends with the time the primary was last
+  /// heard from. The time is default constructed if nothing was received.
+  using closed_handler = std::function<void(std::chrono::steady_clock::time_point last_heard)>;
+
+  /// @param config The primary's address and the replication credentials.
+  /// @param closed Called when the session ends, see `closed_handler`.
+  /// @param policy Segment rollover and retention of the local store.
+  replica_session(
+    asio::io_context& context, const session_config& config, closed_handler closed, segment_policy policy = {})
+    : base_session(asio::ip::tcp::socket{context}, config.session),
+      _host(config.host),
+      _port(config.port),
+      _username(config.username),
+      _password(config.password),
+      _options(config.options),
+      _resolver(context),
+      _closed(std::move(closed)),
+      _policy(std::move(policy))
+  {}
+
+  ~replica_session()
+  {
+    spdlog::info("{}: replication ended at ({}) lag {}", _session_name, _sequence, lag());
+    if(_closed)
+      _closed(_last_heard);
+  }
+
+  /// @brief Opens the local store and logs in to the primary, asking for
+  /// everything after the last replicated message. Throws if the primary
+  /// can't be reached, in which case nothing has been queued.
+  void start()
+  {
+    _database.open(fmt::format("server-{}.db", _session_name), _policy);
+    _sequence = _database.last_output();
+    _head = _sequence;
+    asio::connect(_socket, _resolver.resolve(_host, _port));
+    apply_socket_options(_socket, _options);
+    auto msg = fmt::format("{:<6s}{:<10s}{:<10s}{:<20d}", _username, _password, _session_name, _sequence + 1);
+    dispatch('L', msg);
+    run();
+  }
+
+  /// @brief The number of messages stored on the primary but not yet applied
+  /// here, as of the last heart beat.
+  int lag() const { return std::max(0, _head - _sequence); }
+
+  /// @brief The time since the last message was applied.
+  std::chrono::steady_clock::duration idle() const { return std::chrono::steady_clock::now() - _last_applied; }
+
+private:
+  void process_message(std::string_view msg) override
+  {
+    if(msg.empty())
+      throw std::runtime_error("empty message");
+    _last_heard = std::chrono::steady_clock::now();
+    switch(msg[0])
+    {
+      case 'J':
+        spdlog::info("{}: replication rejected {}", _session_name, msg.substr(1, 1));
+        stop();
+        break;
+      case 'A':
+        spdlog::info(
+          "{}: replication accept {}", _session_name, std::tuple(trim(msg.substr(1, 10)), trim(msg.substr(11, 20))));
+        process_accept(trim(msg.substr(11, 20)));
+        break;
+      case 'S':
+        ++_sequence;
+        _database.replicate_output(_sequence, msg.substr(1));
+        _head = std::max(_head, _sequence);
+        _last_applied = std::chrono::steady_clock::now();
+        break;
+      case 'H':
+        process_heartbeat(msg.substr(1));
+        break;
+      default:
+        spdlog::info("unknown packet type: {}", msg[0]);
+        break;
+    }
+  }
+
+  /// @brief Continues at the sequence number in the accept. If it is past
+  /// the one asked for the primary no longer has the messages in between and
+  /// the local store has a gap.
+  void process_accept(std::string_view accepted)
+  {
+    int next{};
+    auto [ptr, ec] = std::from_chars(accepted.data(), accepted.data() + accepted.length(), next);
+    if(ec != std::errc{} || next <= _sequence + 1)
+      return;
+    spdlog::warn("{}: replication gap ({}-{}), no longer on the primary", _session_name, _sequence + 1, next - 1);
+    _sequence = next - 1;
+  }
+
+  void process_heartbeat(std::string_view head)
+  {
+    _timeout.expires_after(15s);
+    int sequence{};
+    auto [ptr, ec] = std::from_chars(head.data(), head.data() + head.length(), sequence);
+    if(ec != std::errc{})
+      return;
+    _head = sequence;
+    session_stats::set(_stats.replication_lag, lag());
+    if(lag() > 0)
+      spdlog::info("{}: replication lag {} messages, last applied ({}) {} ago", _session_name, lag(), _sequence,
+        std::chrono::duration_cast<std::chrono::milliseconds>(idle()));
+  }
+
+  void timer_handler() override { dispatch('R'); }
+
+  std::string _host;
+  std::string _port;
+  std::string _username;
+  std::string _password;
+  socket_options _options;
+  asio::ip::tcp::resolver _resolver;
+  closed_handler _closed;
+  segment_policy _policy;
+  database _database;
+  int _head{0};
+  std::chrono::steady_clock::time_point _last_heard{};
+  std::chrono::steady_clock::time_point _last_applied{std::chrono::steady_clock::now()};
+};
+} // namespace fixme::soupstock
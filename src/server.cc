@@ -14,12 +14,17 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include "admin.hh"
+#include "execution.hh"
+#include "mold_publisher.hh"
+#include "replica_session.hh"
 #include "server_handler.hh"
 #include "server_session.hh"
 #include "util.hh"
 
 #include <fmt/ranges.h>
 #include <fmt/std.h>
+#include <optional>
 #include <spdlog/spdlog.h>
 #include <system_error>
 #include <unordered_map>
@@ -49,7 +54,7 @@ public:
     {
       auto user{_users.find(username)};
       return user != _users.end() && user->second == password
-        && _active_sessions.emplace(std::string(session_name)).second;
+        && (_feeds.contains(session_name) || _active_sessions.emplace(std::string(session_name)).second);
     }
     return false;
   }
@@ -61,14 +66,81 @@ public:
     place->second.emplace(session);
   }
 
+  /// @brief A feed is a session published over MoldUDP64. Any number of
+  /// receivers may log in to it at the same time to recover gaps.
+  void add_feed(std::string_view user, std::string_view session)
+  {
+    add_session(user, session);
+    _feeds.emplace(session);
+  }
+
+  /// @brief Whether the session is a feed, whose store belongs to its
+  /// publisher.
+  bool feed(std::string_view session_name) const { return _feeds.contains(session_name); }
+
   void remove_session(std::string_view session_name) { _active_sessions.erase(std::string(session_name)); }
 
+  std::size_t active_sessions() const { return _active_sessions.size(); }
+
+  /// @brief Replicators are users allowed to tail the output store of any
+  /// known session from a standby server. Replication doesn't count as an
+  /// active session. There are no replicators unless some are added.
+  bool authenticate_replica(std::string_view username, std::string_view password, std::string_view session_name)
+  {
+    auto replicator{_replicators.find(username)};
+    return replicator != _replicators.end() && replicator->second == password && known(session_name);
+  }
+
+  void add_replicator(std::string_view user, std::string_view password)
+  {
+    _replicators.try_emplace(std::string(user), password);
+  }
+
+  /// @brief All sessions known to the authenticator.
+  std::vector<std::string> sessions() const
+  {
+    std::vector<std::string> result;
+    for(const auto& [user, sessions]: _user_sessions)
+      result.insert(result.end(), sessions.begin(), sessions.end());
+    std::ranges::sort(result);
+    auto [first, last] = std::ranges::unique(result);
+    result.erase(first, last);
+    return result;
+  }
+
 private:
+  bool known(std::string_view session_name) const
+  {
+    return std::ranges::any_of(_user_sessions, [&](const auto& user) { return user.second.contains(session_name); });
+  }
+
   std::unordered_map<std::string, std::string, string_view_hash, string_view_equal> _users;
+  std::unordered_map<std::string, std::string, string_view_hash, string_view_equal> _replicators;
   std::unordered_map<std::string, std::unordered_set<std::string, string_view_hash, string_view_equal>,
     string_view_hash, string_view_equal>
     _user_sessions;
   std::unordered_set<std::string, string_view_hash, string_view_equal> _active_sessions;
+  std::unordered_set<std::string, string_view_hash, string_view_equal> _feeds;
+};
+
+/// @brief Settings applied to every server session.
+struct server_config
+{
+  /// @brief Socket options applied to every accepted connection.
+  socket_options options;
+  /// @brief Segment rollover and retention of the session stores.
+  segment_policy policy;
+  /// @brief The maximum number of received messages in flight per session.
+  /// Zero disables pipelining, see `base_session::set_pipeline`.
+  std::size_t max_in_flight{0};
+  /// @brief Called for every new session, e.g. to register it with the admin
+  /// endpoint.
+  std::function<void(std::shared_ptr<base_session>)> session_created;
+  /// @brief Shares replay reads and bandwidth between sessions. Without a
+  /// scheduler every session replays all at once.
+  std::shared_ptr<replay_scheduler> scheduler;
+  /// @brief Records the traffic of every session, see `fixme::capture`.
+  std::shared_ptr<fixme::capture> traffic_capture;
 };
 
 /// @brief Accepts TCP connections, creating server sessions for each connection.
@@ -79,9 +151,11 @@ public:
   ///
   /// @param context The asio::io_context object. Need to create the acceptor.
   /// @param port The port on which the server accepts connections.
-  server(std::shared_ptr<authenticator> authenticator, asio::io_context& context, short port)
+  /// @param config Settings applied to every session.
+  server(std::shared_ptr<authenticator> authenticator, asio::io_context& context, short port, server_config config = {})
     : _acceptor(context, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port)),
-      _authenticator(std::move(authenticator))
+      _authenticator(std::move(authenticator)),
+      _config(std::move(config))
   {
     accept();
   }
@@ -108,27 +182,262 @@ private:
   {
     spdlog::info(
       "creating session on: {}:{}", socket.remote_endpoint().address().to_string(), socket.remote_endpoint().port());
-    std::make_shared<soupstock::server_session<server_handler, authenticator>>(
-      std::move(socket), _authenticator, [this](std::string_view session_name) { remove_session(session_name); })
-      ->run();
+    apply_socket_options(socket, _config.options);
+    auto session = std::make_shared<soupstock::server_session<server_handler, authenticator>>(
+      std::move(socket), _authenticator, [this](std::string_view session_name) { remove_session(session_name); },
+      _config.policy);
+    session->set_pipeline(_config.max_in_flight);
+    session->set_capture(_config.traffic_capture);
+    session->set_replay_scheduler(_config.scheduler);
+    if(_config.session_created)
+      _config.session_created(session);
+    session->run();
   }
 
   /// @brief The acceptor.
   asio::ip::tcp::acceptor _acceptor;
   std::shared_ptr<authenticator> _authenticator;
+  server_config _config;
+};
+
+/// @brief A hot standby for a primary server.
+///
+/// Keeps one replication session per known session and with it the local
+/// stores current. A replication session which can't connect or ends, e.g.
+/// after a reject, a timeout or a network glitch, is started again after a
+/// backoff which doubles up to `max_backoff`.
+///
+/// The standby takes over by starting a server on its own port once no
+/// replication session is connected and the primary hasn't been heard from
+/// for `takeover_after`. A reject counts as hearing from the primary, so a
+/// primary which is up never has its sessions taken over.
+class standby
+{
+public:
+  standby(std::shared_ptr<authenticator> authenticator, asio::io_context& context, short port, session_config primary,
+    server_config config = {}, std::chrono::seconds takeover_after = 30s)
+    : _context(context),
+      _authenticator(std::move(authenticator)),
+      _port(port),
+      _primary(std::move(primary)),
+      _config(std::move(config)),
+      _takeover_after(takeover_after),
+      _last_heard(std::chrono::steady_clock::now())
+  {
+    for(const auto& name: _authenticator->sessions())
+      asio::co_spawn(_context, replicate(name), asio::detached);
+    asio::co_spawn(_context, watch(), asio::detached);
+  }
+
+private:
+  /// @brief Runs replication sessions for one session until the standby takes
+  /// over.
+  asio::awaitable<void> replicate(std::string name)
+  {
+    asio::steady_timer timer(_context);
+    auto backoff = min_backoff;
+    while(!_server)
+    {
+      auto config = _primary;
+      config.session = name;
+      auto started = std::chrono::steady_clock::now();
+      try
+      {
+        // The session reports its end through the timer, which the loop
+        // waits on while the session is connected.
+        timer.expires_at(std::chrono::steady_clock::time_point::max());
+        auto replica = std::make_shared<replica_session>(
+          _context, config,
+          [this, &timer](auto last_heard) {
+            _last_heard = std::max(_last_heard, last_heard);
+            timer.cancel();
+          },
+          _config.policy);
+        replica->start();
+        replica.reset();
+        ++_connected;
+        asio::error_code ec;
+        co_await timer.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+        --_connected;
+      }
+      catch(const std::exception& ex)
+      {
+        spdlog::info("{}: replication: {}", name, ex.what());
+      }
+      // A session which stayed up for a while was not a failed attempt.
+      if(std::chrono::steady_clock::now() - started >= max_backoff)
+        backoff = min_backoff;
+      spdlog::info("{}: reconnecting to the primary in {}", name, backoff);
+      timer.expires_after(backoff);
+      asio::error_code ec;
+      co_await timer.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+      backoff = std::min(backoff * 2, max_backoff);
+    }
+  }
+
+  /// @brief Takes over once the primary has been silent for long enough.
+  asio::awaitable<void> watch()
+  {
+    asio::steady_timer timer(_context);
+    while(!_server)
+    {
+      timer.expires_after(1s);
+      co_await timer.async_wait(asio::use_awaitable);
+      if(_connected > 0 || std::chrono::steady_clock::now() - _last_heard < _takeover_after)
+        continue;
+      spdlog::info("primary silent for {}, taking over on port {}", _takeover_after, _port);
+      _server.emplace(_authenticator, _context, _port, _config);
+    }
+  }
+
+  static constexpr std::chrono::milliseconds min_backoff{100ms};
+  static constexpr std::chrono::milliseconds max_backoff{5s};
+
+  asio::io_context& _context;
+  std::shared_ptr<authenticator> _authenticator;
+  short _port;
+  session_config _primary;
+  server_config _config;
+  std::chrono::seconds _takeover_after;
+  /// @brief The last time any replication session received something.
+  std::chrono::steady_clock::time_point _last_heard;
+  int _connected{0};
+  std::optional<server> _server;
 };
+
+/// @brief Publishes the time every second on a MoldUDP64 feed, as an example
+/// of a broadcast stream.
+asio::awaitable<void> publish_clock(mold_publisher& publisher)
+{
+  asio::steady_timer timer(co_await asio::this_coro::executor);
+  while(true)
+  {
+    timer.expires_after(1s);
+    co_await timer.async_wait(asio::use_awaitable);
+    publisher.publish(fmt::format("{:%Y-%m-%d %H:%M:%S}",
+      std::chrono::time_point_cast<std::chrono::milliseconds>(std::chrono::system_clock::now())));
+  }
+}
 } // namespace fixme::soupstock
 
 int main(int argc, char* argv[])
 {
   try
   {
-    asio::io_context context;
+    // The server always has work pending, so the wake-up probe can't keep it
+    // running longer than it otherwise would.
+    fixme::soupstock::execution_config config{.probe_interval = 100ms};
+    fixme::soupstock::server_config server_config;
+    auto args = fixme::soupstock::parse_execution_options(argc, argv, config, server_config.options);
+    short port{25000};
+    std::optional<fixme::soupstock::session_config> primary;
+    std::optional<std::pair<std::string, std::string>> replicator;
+    std::chrono::seconds takeover_after{30s};
+    auto& policy = server_config.policy;
+    unsigned short admin_port{0};
+    fixme::soupstock::replay_config replay;
+    std::optional<fixme::soupstock::publisher_config> feed;
+    for(std::size_t i = 0; i < args.size(); ++i)
+    {
+      if(args[i] == "--port" && i + 1 < args.size())
+        port = fixme::soupstock::parse_number<short>(args, i);
+      else if(args[i] == "--segment-bytes" && i + 1 < args.size())
+        policy.max_bytes = fixme::soupstock::parse_number<std::uintmax_t>(args, i);
+      else if(args[i] == "--segment-age" && i + 1 < args.size())
+        policy.max_age = std::chrono::seconds(fixme::soupstock::parse_number<std::int64_t>(args, i));
+      else if(args[i] == "--segments" && i + 1 < args.size())
+        policy.max_segments = fixme::soupstock::parse_number<std::size_t>(args, i);
+      else if(args[i] == "--archive" && i + 1 < args.size())
+        policy.archive_directory = args[++i];
+      else if(args[i] == "--wire-log")
+        policy.wire_log = true;
+      else if(args[i] == "--pipeline" && i + 1 < args.size())
+        server_config.max_in_flight = fixme::soupstock::parse_number<std::size_t>(args, i);
+      else if(args[i] == "--capture" && i + 1 < args.size())
+        server_config.traffic_capture = std::make_shared<fixme::capture>(std::string(args[++i]));
+      else if(args[i] == "--replay-budget" && i + 1 < args.size())
+        replay.budget = fixme::soupstock::parse_number<std::size_t>(args, i);
+      else if(args[i] == "--replay-quantum" && i + 1 < args.size())
+        replay.quantum = fixme::soupstock::parse_number<std::size_t>(args, i);
+      else if(args[i] == "--admin" && i + 1 < args.size())
+        admin_port = fixme::soupstock::parse_number<unsigned short>(args, i);
+      else if(args[i] == "--feed" && i + 1 < args.size())
+      {
+        // The feed destination is given as address:port, either a multicast
+        // group or a unicast receiver. Repeat for more receivers.
+        auto address = args[++i];
+        auto colon = address.rfind(':');
+        if(colon == std::string_view::npos)
+          throw std::runtime_error(fmt::format("--feed: expected address:port: {}", address));
+        if(!feed)
+          feed = fixme::soupstock::publisher_config{.session = "feed"};
+        feed->destinations.emplace_back(asio::ip::make_address(std::string(address.substr(0, colon))),
+          fixme::soupstock::parse_number<unsigned short>("--feed", address.substr(colon + 1)));
+      }
+      else if(args[i] == "--standby" && i + 1 < args.size())
+      {
+        // The primary is given as host:port.
+        auto address = args[++i];
+        auto colon = address.rfind(':');
+        if(colon == std::string_view::npos)
+          throw std::runtime_error(fmt::format("--standby: expected host:port: {}", address));
+        primary = fixme::soupstock::session_config{std::string(address.substr(0, colon)),
+          std::string(address.substr(colon + 1)), "", "", "", server_config.options};
+      }
+      else if(args[i] == "--replicator" && i + 1 < args.size())
+      {
+        // The replication credentials are given as user:password. The primary
+        // accepts them and the standby logs in with them.
+        auto credentials = args[++i];
+        auto colon = credentials.find(':');
+        if(colon == std::string_view::npos)
+          throw std::runtime_error(fmt::format("--replicator: expected user:password: {}", credentials));
+        replicator.emplace(credentials.substr(0, colon), credentials.substr(colon + 1));
+      }
+      else if(args[i] == "--takeover-after" && i + 1 < args.size())
+        takeover_after = std::chrono::seconds(fixme::soupstock::parse_number<std::int64_t>(args, i));
+      else
+        spdlog::warn("unknown argument: {}", args[i]);
+    }
+    if(primary)
+    {
+      if(!replicator)
+        throw std::runtime_error("--standby requires --replicator");
+      primary->username = replicator->first;
+      primary->password = replicator->second;
+    }
+    asio::io_context context{1};
+    server_config.scheduler = std::make_shared<fixme::soupstock::replay_scheduler>(context, replay);
     auto authenticator{std::make_shared<fixme::soupstock::authenticator>()};
     authenticator->add_user("user1", "password1");
     authenticator->add_session("user1", "session1");
-    fixme::soupstock::server s(std::move(authenticator), context, 25000);
-    context.run();
+    if(replicator)
+      authenticator->add_replicator(replicator->first, replicator->second);
+    if(feed)
+      authenticator->add_feed("user1", feed->session);
+    std::optional<fixme::soupstock::admin<fixme::soupstock::authenticator>> admin;
+    if(admin_port != 0)
+    {
+      admin.emplace(context, admin_port, authenticator);
+      server_config.session_created = [&admin](auto session) { admin->add_session(session); };
+    }
+    std::optional<fixme::soupstock::server> s;
+    std::optional<fixme::soupstock::standby> standby;
+    if(primary)
+      standby.emplace(std::move(authenticator), context, port, *primary, server_config, takeover_after);
+    else
+      s.emplace(std::move(authenticator), context, port, server_config);
+    std::optional<fixme::soupstock::mold_publisher> publisher;
+    if(feed && !primary)
+    {
+      feed->policy = policy;
+      publisher.emplace(context, *feed);
+      asio::co_spawn(context, fixme::soupstock::publish_clock(*publisher), asio::detached);
+    }
+    fixme::soupstock::runner runner(context, config);
+    if(admin)
+      admin->set_runner(runner);
+    runner.run();
   }
   catch(const std::exception& ex)
   {
@@ -52,6 +52,13 @@ public:
         std::make_error_code(ec).message());
       return session.reject_login("A");
     }
+    if(_authenticator->authenticate_replica(username, password, session_name))
+    {
+      _session_name = session_name;
+      spdlog::info("{}: accept replication {}", _session_name, std::tuple(username, session_name, sequence_number));
+      session.replay_sequenced(session.accept_replication(_session_name, sequence));
+      return;
+    }
     if(!_authenticator->authenticate(username, password, session_name))
     {
       spdlog::info("reject login {}", std::tuple(username, password, session_name, sequence_number));
@@ -59,8 +66,16 @@ public:
     }
     _session_name = session_name;
     spdlog::info("{}: accept login {}", _session_name, std::tuple(username, password, session_name, sequence_number));
-    session.accept_login(_session_name, fmt::format("{:>10}{:>20}", session_name, sequence));
-    session.replay_sequenced(sequence);
+    // A client asking for compression sends one more byte after the standard
+    // fields and gets it echoed in the accept. Plain clients see a standard
+    // accept.
+    auto compress = msg.size() > 46 && msg[46] == 'C';
+    std::string_view options{compress ? "C" : ""};
+    // A feed's store belongs to its publisher, so logins to it only recover.
+    auto first = _authenticator->feed(_session_name) ? session.accept_recovery(_session_name, sequence, options)
+                                                     : session.accept_login(_session_name, sequence, options);
+    session.set_compression(compress);
+    session.replay_sequenced(first);
     return;
   }
 
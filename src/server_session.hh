@@ -18,11 +18,15 @@
 
 #include "base_session.hh"
 #include "database.hh"
+#include "mpsc_queue.hh"
+#include "replay_scheduler.hh"
 
 #include <asio.hpp>
+#include <atomic>
 #include <chrono>
 #include <fmt/chrono.h>
 #include <fmt/ranges.h>
+#include <span>
 #include <spdlog/spdlog.h>
 
 using namespace std::literals;
@@ -34,41 +38,134 @@ class server_session: public base_session
 {
 public:
   server_session(asio::ip::tcp::socket socket, std::shared_ptr<Authenticator> authenticator,
-    std::function<void(std::string_view session_name)> remove_session)
+    std::function<void(std::string_view session_name)> remove_session, segment_policy policy = {})
     : base_session(std::move(socket)),
       _handler(std::make_unique<Handler<Authenticator>>(std::move(authenticator))),
-      _remove_session(std::move(remove_session))
+      _remove_session(std::move(remove_session)),
+      _policy(std::move(policy)),
+      _tail(_strand)
   {}
 
   ~server_session()
   {
-    if(!_session_name.empty() && _remove_session)
+    if(!_session_name.empty() && !_replica && _remove_session)
       _remove_session(_session_name);
   }
 
+  /// @brief Sends a sequenced message. Must be called on the session's
+  /// strand, e.g. from the handler. Other threads use `publish`.
   void send_sequenced(std::string_view msg)
   {
-    ++_sequence;
+    auto start = std::chrono::steady_clock::now();
+    _sequence = _database.store_output(msg);
+    _stats.database_write(std::chrono::steady_clock::now() - start);
     spdlog::info("{}: sequenced ({}) {}", _session_name, _sequence, msg);
-    _database.store_output(msg);
-    dispatch('S', msg);
+    // While replaying, the message is sent by the replay when it gets there.
+    if(!_replaying)
+      dispatch('S', msg);
   }
 
+  /// @brief Sends a burst of related messages.
+  ///
+  /// The messages get a contiguous block of sequence numbers, are stored in
+  /// one transaction and are queued for sending with one hop to the strand.
+  void send_sequenced(std::span<const std::string_view> msgs)
+  {
+    if(msgs.empty())
+      return;
+    auto start = std::chrono::steady_clock::now();
+    auto first = _database.store_output(msgs);
+    _stats.database_write(std::chrono::steady_clock::now() - start);
+    _sequence = first + static_cast<int>(msgs.size()) - 1;
+    spdlog::info("{}: sequenced ({}-{}) {} messages", _session_name, first, _sequence, msgs.size());
+    if(!_replaying)
+      dispatch('S', msgs);
+  }
+
+  /// @brief Sends a sequenced message from any thread.
+  ///
+  /// The message is pushed onto a lock-free queue and, unless one is already
+  /// pending, a drain is posted to the session's strand. The drain assigns
+  /// sequence numbers to, stores and frames everything queued so far as one
+  /// batch, see `send_sequenced`. Messages published before the login is
+  /// accepted are sent after the accept.
+  void publish(std::string msg)
+  {
+    _published.push(std::move(msg));
+    schedule_drain();
+  }
+
+  /// @brief Replays through a server-wide scheduler rather than all at once.
+  void set_replay_scheduler(std::shared_ptr<replay_scheduler> scheduler) { _scheduler = std::move(scheduler); }
+
   void reject_login(std::string_view reason) { dispatch('J', reason); }
 
-  void accept_login(std::string_view session_name, std::string_view msg)
+  /// @brief Accepts a login asking for messages from `sequence` onwards.
+  ///
+  /// If the retention policy has dropped some of them the accept carries the
+  /// first sequence number still available instead, since the packets sent
+  /// don't carry sequence numbers. `options` follows the standard fields.
+  /// Returns the sequence number in the accept, where the replay starts.
+  int accept_login(std::string_view session_name, int sequence, std::string_view options = {})
+  {
+    _session_name = session_name;
+    if(_recovery)
+      _database.open_reader(fmt::format("server-{}.db", _session_name));
+    else
+      _database.open(fmt::format("server-{}.db", _session_name), _policy);
+    sequence = first_available(sequence);
+    dispatch('A', fmt::format("{:>10}{:>20}{}", session_name, sequence, options));
+    _accepted = true;
+    if(!_published.empty())
+      schedule_drain();
+    return sequence;
+  }
+
+  /// @brief Accepts a login to the recovery session of a MoldUDP64 feed.
+  ///
+  /// The store belongs to the feed's publisher, so it is opened for reading
+  /// only and unsequenced messages, which could be sequenced into it, are
+  /// refused. Otherwise the same as `accept_login`.
+  int accept_recovery(std::string_view session_name, int sequence, std::string_view options = {})
+  {
+    _recovery = true;
+    return accept_login(session_name, sequence, options);
+  }
+
+  /// @brief Accepts a replication session from a standby server.
+  ///
+  /// A replication session tails the output store of the named session
+  /// instead of sending application messages. Heart beats carry the highest
+  /// sequence number in the store so the standby can compute its lag. The
+  /// store is opened for reading only, it belongs to the client session.
+  /// Returns the sequence number in the accept, see `accept_login`.
+  int accept_replication(std::string_view session_name, int sequence)
   {
     _session_name = session_name;
-    dispatch('A', msg);
-    _database.open(fmt::format("server-{}.db", _session_name));
+    _replica = true;
+    _database.open_reader(fmt::format("server-{}.db", _session_name));
+    sequence = first_available(sequence);
+    dispatch('A', fmt::format("{:>10}{:>20}", session_name, sequence));
+    return sequence;
   }
 
   void replay_sequenced(int sequence)
   {
+    if(_replica)
+    {
+      _sequence = sequence - 1;
+      auto self = std::static_pointer_cast<server_session>(shared_from_this());
+      asio::co_spawn(_strand, [self] { return self->tail(); }, asio::detached);
+      return;
+    }
     _sequence = sequence;
     replay_sequenced();
   }
 
+  /// @brief The number of messages in the output store not yet sent to the
+  /// standby.
+  int replication_lag() const { return _head - _sequence; }
+
 private:
   void process_message(std::string_view msg) override
   {
@@ -85,7 +182,13 @@ private:
       case 'S':
         break;
       case 'U':
-        _handler->process_unsequenced(*this, msg.substr(1));
+        if(_recovery)
+        {
+          spdlog::warn("{}: unsequenced message refused on a recovery session", _session_name);
+          break;
+        }
+        if constexpr(!is_awaitable<decltype(_handler->process_unsequenced(*this, msg))>::value)
+          _handler->process_unsequenced(*this, msg.substr(1));
         break;
       case 'R':
         _timeout.expires_after(15s);
@@ -100,23 +203,262 @@ private:
     }
   }
 
-  void timer_handler() override { dispatch('H'); }
+  /// @brief Awaits handlers whose `process_unsequenced` returns an
+  /// `asio::awaitable`. Everything else is processed by `process_message`.
+  /// Timers and writes run on the strand while the handler is suspended, but
+  /// the reader waits for it unless pipelining is enabled.
+  asio::awaitable<void> process_message_async(std::string msg) override
+  {
+    if constexpr(is_awaitable<decltype(_handler->process_unsequenced(*this, std::string_view{}))>::value)
+    {
+      if(!msg.empty() && msg[0] == 'U' && !_recovery)
+      {
+        co_await _handler->process_unsequenced(*this, std::string_view(msg).substr(1));
+        co_return;
+      }
+    }
+    process_message(msg);
+  }
+
+  void timer_handler() override
+  {
+    if(!_replica)
+      return dispatch('H');
+    _head = _database.last_output();
+    session_stats::set(_stats.replication_lag, replication_lag());
+    if(replication_lag() > 0)
+      spdlog::debug("{}: replication lag {}", _session_name, replication_lag());
+    dispatch('H', fmt::format("{}", _head));
+  }
+
+  /// @brief Sends new messages from the output store to a standby server.
+  ///
+  /// The store is polled every `tail_interval` since the messages are written
+  /// by the session which owns the store, not by this one. A backlog is read
+  /// `tail_bytes` at a time. The next part is read right away while the
+  /// writer keeps up and after `tail_interval` otherwise.
+  asio::awaitable<void> tail()
+  {
+    try
+    {
+      while(_socket.is_open())
+      {
+        auto rows = _database.load_output(_sequence + 1, tail_bytes);
+        std::size_t bytes{0};
+        for(const auto& r: rows)
+        {
+          _sequence = r.sequence;
+          bytes += r.message.size();
+          dispatch('S', r.message);
+        }
+        if(!rows.empty())
+        {
+          _head = std::max(_head, _sequence);
+          session_stats::set(_stats.replication_lag, replication_lag());
+        }
+        if(bytes >= tail_bytes && _messages.size() < max_batch)
+        {
+          co_await asio::post(_strand, asio::use_awaitable);
+          continue;
+        }
+        _tail.expires_after(tail_interval);
+        asio::error_code ec;
+        co_await _tail.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+      }
+    }
+    catch(const std::exception& ex)
+    {
+      spdlog::info("{}: exception: {}", _session_name, ex.what());
+      stop();
+    }
+  }
+
+  /// @brief Returns `sequence` or, if the messages from there on are no
+  /// longer in the store, the first one which is.
+  int first_available(int sequence)
+  {
+    auto first = _database.first_output();
+    if(sequence >= first)
+      return sequence;
+    if(sequence > 0)
+      spdlog::warn("{}: ({}-{}) no longer available, starting at ({})", _session_name, sequence, first - 1, first);
+    return first;
+  }
+
+  void schedule_drain()
+  {
+    if(_drain_scheduled.exchange(true, std::memory_order_acq_rel))
+      return;
+    auto self = std::static_pointer_cast<server_session>(shared_from_this());
+    asio::post(_strand, [self] { self->drain(); });
+  }
+
+  /// @brief Sends published messages, at most `max_drain` per turn on the
+  /// strand so that a busy producer doesn't starve the session.
+  ///
+  /// The pending flag is cleared before checking the queue one last time. A
+  /// producer which pushes after the check sees the flag cleared and posts a
+  /// new drain.
+  ///
+  /// A queue which isn't empty but has nothing to pop has a producer between
+  /// the two steps of `push`. Rather than spin until it links its message the
+  /// drain is posted again behind whatever else is waiting for the strand.
+  void drain()
+  {
+    try
+    {
+      while(_accepted)
+      {
+        std::vector<std::string> msgs;
+        bool linking{false};
+        while(msgs.size() < max_drain)
+        {
+          auto msg = _published.pop();
+          if(!msg)
+          {
+            linking = !_published.empty();
+            break;
+          }
+          msgs.push_back(std::move(*msg));
+        }
+        if(!msgs.empty())
+        {
+          std::vector<std::string_view> views(msgs.begin(), msgs.end());
+          send_sequenced(views);
+        }
+        if(msgs.size() == max_drain || linking)
+        {
+          auto self = std::static_pointer_cast<server_session>(shared_from_this());
+          asio::post(_strand, [self] { self->drain(); });
+          return;
+        }
+        _drain_scheduled.exchange(false, std::memory_order_acq_rel);
+        if(_published.empty() || _drain_scheduled.exchange(true, std::memory_order_acq_rel))
+          return;
+      }
+    }
+    catch(const std::exception& ex)
+    {
+      spdlog::info("{}: exception: {}", _session_name, ex.what());
+      stop();
+    }
+    _drain_scheduled.exchange(false, std::memory_order_acq_rel);
+  }
 
-  void replay_sequenced() { load_messages(); }
+  /// @brief Sends the stored messages from `_sequence` onwards.
+  ///
+  /// Without a scheduler the whole replay is queued at once. With one, the
+  /// replay is read and queued in steps handed out by the scheduler and
+  /// messages sequenced in the meantime are sent by the replay.
+  void replay_sequenced()
+  {
+    _replay_next = _sequence;
+    _replay_first = _sequence;
+    _replay_target = _database.last_output();
+    _replay_started = std::chrono::steady_clock::now();
+    if(!_scheduler)
+    {
+      while(replay(std::numeric_limits<std::size_t>::max()))
+        ;
+      return;
+    }
+    _replaying = true;
+    std::weak_ptr<base_session> weak = shared_from_this();
+    _scheduler->add(_strand, [weak](std::size_t allowance) -> std::optional<std::size_t> {
+      auto self = std::static_pointer_cast<server_session>(weak.lock());
+      if(!self)
+        return std::nullopt;
+      return self->replay(allowance);
+    });
+  }
 
-  void load_messages()
+  /// @brief Queues about `allowance` bytes of the replay. Returns the number
+  /// of bytes queued or `std::nullopt` once the replay has caught up.
+  std::optional<std::size_t> replay(std::size_t allowance)
   {
-    auto rows = _database.load_output(_sequence);
-    for(const auto& r: rows)
+    if(!_socket.is_open())
+    {
+      _replaying = false;
+      return std::nullopt;
+    }
+    if(_scheduler && _messages.size() >= _scheduler->config().max_queue)
+      return 0;
+    std::size_t bytes{0};
+    // A file range can't be compressed, so compressing sessions replay rows.
+    if(auto range = _policy.wire_log && !compression() ? _database.wire_output(_replay_next, allowance) : std::nullopt)
+    {
+      // Already framed on disk, sent with sendfile.
+      _sequence = std::max(_sequence, range->last);
+      _replay_next = range->last + 1;
+      bytes = range->length;
+      spdlog::info("{}: replay ({}-{}) from the wire log", _session_name, range->first, range->last);
+      dispatch(file_range{range->file, range->offset, range->length,
+        static_cast<std::size_t>(range->last - range->first + 1)});
+    }
+    else
     {
-      _sequence = r.sequence;
-      spdlog::info("{}: replay ({}) '{}'", _session_name, _sequence, r.message);
-      dispatch('S', r.message);
+      auto rows = _database.read_output(_replay_next, allowance);
+      for(const auto& r: rows)
+      {
+        _sequence = std::max(_sequence, r.sequence);
+        _replay_next = r.sequence + 1;
+        bytes += r.message.size();
+        spdlog::info("{}: replay ({}) '{}'", _session_name, r.sequence, r.message);
+        dispatch('S', r.message);
+      }
     }
+    // The head of the store is only looked up again once the replay has
+    // caught up with it.
+    if(_replay_next > _replay_target)
+      _replay_target = _database.last_output();
+    auto target = _replay_target;
+    session_stats::set(_stats.replay_target, target);
+    session_stats::set(_stats.replay_position, _replay_next - 1);
+    auto elapsed = std::chrono::steady_clock::now() - _replay_started;
+    if(_replay_next > target)
+    {
+      _replaying = false;
+      session_stats::set(_stats.replay_eta_ms, 0);
+      session_stats::set(
+        _stats.replay_duration_ms, std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count());
+      if(_replay_next > _replay_first)
+        spdlog::info("{}: replay of {} messages completed in {}", _session_name, _replay_next - _replay_first,
+          std::chrono::duration_cast<std::chrono::milliseconds>(elapsed));
+      return std::nullopt;
+    }
+    // The estimate assumes the replay keeps its average rate so far.
+    auto done = _replay_next - _replay_first;
+    if(done > 0)
+      session_stats::set(_stats.replay_eta_ms,
+        std::chrono::duration_cast<std::chrono::milliseconds>(elapsed * (target - _replay_next + 1) / done).count());
+    return bytes;
   }
 
   std::unique_ptr<Handler<Authenticator>> _handler;
   std::function<void(std::string_view session_name)> _remove_session;
+  segment_policy _policy;
   database _database;
+  std::shared_ptr<replay_scheduler> _scheduler;
+
+  /// @brief The most published messages sent by one drain.
+  static constexpr std::size_t max_drain{1024};
+  mpsc_queue<std::string> _published;
+  std::atomic<bool> _drain_scheduled{false};
+  bool _accepted{false};
+  bool _replaying{false};
+  int _replay_first{0};
+  int _replay_next{0};
+  /// @brief The head of the store when last looked up by the replay.
+  int _replay_target{0};
+  std::chrono::steady_clock::time_point _replay_started;
+
+  static constexpr auto tail_interval{10ms};
+  /// @brief The most bytes read from the store in one step of `tail`.
+  static constexpr std::size_t tail_bytes{64 * 1024};
+  bool _replica{false};
+  /// @brief Logged in to a feed's recovery session, see `accept_recovery`.
+  bool _recovery{false};
+  int _head{0};
+  asio::steady_timer _tail;
 };
 } // namespace fixme::soupstock
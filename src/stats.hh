@@ -0,0 +1,109 @@
+// soupstock - a soupbintcp library
+//
+// Copyright 2025 Krister Joas
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace fixme
+{
+/// @brief Live counters of a session.
+///
+/// Every counter has a single writer, the session's strand, so updates are a
+/// relaxed load and store rather than a locked read-modify-write. Readers,
+/// e.g. the admin endpoint, see a recent value without synchronizing with the
+/// session.
+struct session_stats
+{
+  using counter = std::atomic<std::uint64_t>;
+  using gauge = std::atomic<std::int64_t>;
+
+  static void add(counter& c, std::uint64_t n = 1)
+  {
+    c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  static void set(gauge& g, std::int64_t value) { g.store(value, std::memory_order_relaxed); }
+
+  static std::uint64_t get(const counter& c) { return c.load(std::memory_order_relaxed); }
+  static std::int64_t get(const gauge& g) { return g.load(std::memory_order_relaxed); }
+
+  /// @brief Frames sent from one outbound lane and how long they waited.
+  struct lane
+  {
+    counter frames{};
+    counter wait_ns{};
+    gauge max_wait_ns{};
+  };
+
+  /// @brief Records the time a frame spent in an outbound lane.
+  static void queued(lane& l, std::chrono::steady_clock::duration elapsed)
+  {
+    auto ns = std::chrono::nanoseconds(elapsed).count();
+    add(l.frames);
+    add(l.wait_ns, static_cast<std::uint64_t>(ns));
+    if(ns > get(l.max_wait_ns))
+      set(l.max_wait_ns, ns);
+  }
+
+  /// @brief Records the time spent writing to the message store.
+  void database_write(std::chrono::steady_clock::duration elapsed)
+  {
+    add(database_writes);
+    add(database_write_ns, static_cast<std::uint64_t>(std::chrono::nanoseconds(elapsed).count()));
+  }
+
+  counter messages_in{};
+  counter bytes_in{};
+  counter messages_out{};
+  counter bytes_out{};
+  counter heartbeats_in{};
+  counter heartbeats_out{};
+  counter timeouts{};
+  /// @brief Sequenced messages received again after a reconnect and dropped.
+  counter duplicates{};
+  /// @brief Sequenced messages the server no longer had after a reconnect.
+  counter gaps{};
+  /// @brief Bytes given to the compressor, bytes it produced and the time it
+  /// took.
+  counter compression_in{};
+  counter compression_out{};
+  counter compression_ns{};
+  counter database_writes{};
+  counter database_write_ns{};
+  /// @brief Messages waiting in the outbound lanes.
+  gauge queue_depth{};
+  /// @brief Login responses, heart beats and other control packets.
+  lane control_lane{};
+  /// @brief Sequenced and unsequenced data.
+  lane data_lane{};
+  gauge sequence{};
+  /// @brief The last sequence number of the most recent replay. The replay is
+  /// complete when the position reaches the target.
+  gauge replay_target{};
+  /// @brief The last sequence number queued by the most recent replay.
+  gauge replay_position{};
+  /// @brief Estimated time until the replay catches up.
+  gauge replay_eta_ms{};
+  /// @brief How long the most recent completed replay took.
+  gauge replay_duration_ms{};
+  /// @brief Messages in the primary's store not yet sent to, or applied by,
+  /// a standby. Only replication sessions set it.
+  gauge replication_lag{};
+};
+} // namespace fixme
@@ -0,0 +1,82 @@
+# soupstock - a soupbintcp library
+#
+# Copyright 2025 Krister Joas
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Helpers shared by the loopback tests. Every process runs in its own
+# directory under a scratch directory, so each has its own message stores,
+# and logs to NAME.log next to it.
+
+set -u
+name=$(basename "$0" .sh)
+server=$1
+client=$2
+scratch=$(mktemp -d)
+pids=""
+
+cleanup()
+{
+  [ -n "$pids" ] && kill $pids 2>/dev/null
+  wait 2>/dev/null
+  rm -rf "$scratch"
+}
+trap cleanup EXIT
+
+fail()
+{
+  echo "$name: $*"
+  for log in "$scratch"/*.log; do
+    echo "--- $log"
+    cat "$log"
+  done
+  exit 1
+}
+
+# start NAME COMMAND...: runs COMMAND in the background.
+start()
+{
+  mkdir -p "$scratch/$1"
+  log="$scratch/$1.log"
+  dir="$scratch/$1"
+  shift
+  (cd "$dir" && exec "$@") > "$log" 2>&1 &
+  pids="$pids $!"
+}
+
+# run NAME COMMAND...: runs COMMAND in the foreground, e.g. a client reading
+# its commands from a pipe.
+run()
+{
+  mkdir -p "$scratch/$1"
+  log="$scratch/$1.log"
+  dir="$scratch/$1"
+  shift
+  (cd "$dir" && exec "$@") > "$log" 2>&1
+}
+
+# wait_for NAME PATTERN: waits up to ten seconds for PATTERN in NAME's log.
+wait_for()
+{
+  for i in $(seq 100); do
+    grep -qF "$2" "$scratch/$1.log" 2>/dev/null && return 0
+    sleep 0.1
+  done
+  fail "timed out waiting for '$2' from $1"
+}
+
+# expect NAME PATTERN: fails unless PATTERN is in NAME's log.
+expect()
+{
+  grep -qF "$2" "$scratch/$1.log" || fail "expected '$2' from $1"
+}
@@ -0,0 +1,46 @@
+#!/bin/sh
+# soupstock - a soupbintcp library
+#
+# Copyright 2025 Krister Joas
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Kills a primary server on loopback and checks that the standby takes over
+# with the primary's messages.
+#
+#   failover.sh SERVER CLIENT
+
+. "$(dirname "$0")/common.sh"
+
+primary_port=25100
+standby_port=25101
+
+# The standby starts first and keeps retrying until the primary is up.
+start standby "$server" --port $standby_port --standby 127.0.0.1:$primary_port --replicator repl:replpass \
+  --takeover-after 2
+wait_for standby "reconnecting to the primary"
+start primary "$server" --port $primary_port --replicator repl:replpass
+primary=$!
+wait_for standby "replication accept"
+
+# The client reads one command per read from stdin, so they are paced.
+{ for i in 1 2 3; do echo date; sleep 0.2; done; sleep 0.5; echo logout; } | run client1 "$client" --server 127.0.0.1:$primary_port
+expect client1 "sequenced (3)"
+
+kill -9 $primary
+wait_for standby "replication ended at (3)"
+wait_for standby "taking over"
+
+{ sleep 1; echo logout; } | run client2 "$client" --server 127.0.0.1:$standby_port
+expect client2 "sequenced (3)"
+echo "failover: ok"
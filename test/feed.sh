@@ -0,0 +1,49 @@
+#!/bin/sh
+# soupstock - a soupbintcp library
+#
+# Copyright 2025 Krister Joas
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Receives the server's MoldUDP64 feed over loopback multicast after it has
+# started, so the first messages have to be recovered over SoupBinTCP.
+#
+#   feed.sh SERVER CLIENT
+
+. "$(dirname "$0")/common.sh"
+
+port=25120
+group=239.255.25.1:25121
+
+# The server publishes the time on the feed every second.
+start server "$server" --port $port --feed $group
+sleep 3.5
+
+# Nothing listens on the recovery port, so the recovery is retried while the
+# feed keeps being received, and only one message is kept ahead of the gap.
+{ sleep 3; echo logout; } | run client1 "$client" --server 127.0.0.1:$port --feed $group \
+  --recovery 127.0.0.1:25129 --max-pending 1
+expect client1 "feed: gap (1-"
+expect client1 "1 messages pending, leaving the rest to recovery"
+[ "$(grep -c 'feed: recovery failed' "$scratch/client1.log")" -ge 2 ] || fail "expected client1 to retry the recovery"
+
+# The feed's recovery session only reads the publisher's store, so a message
+# sequenced on it would collide with the publisher's numbering.
+{ echo date; sleep 0.5; echo logout; } | run client3 "$client" --server 127.0.0.1:$port --session feed
+expect server "feed: unsequenced message refused on a recovery session"
+
+# The store was left at the gap, so this client recovers from the server.
+{ sleep 3; echo logout; } | run client2 "$client" --server 127.0.0.1:$port --feed $group
+expect client2 "feed: gap filled"
+expect client2 "feed: sequenced (1)"
+echo "feed: ok"
@@ -0,0 +1,42 @@
+#!/bin/sh
+# soupstock - a soupbintcp library
+#
+# Copyright 2025 Krister Joas
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Replays a store spread over several segments in small scheduler steps,
+# from the tables and from the wire log, and checks that every message
+# arrives once and in order.
+#
+#   replay.sh SERVER CLIENT
+
+. "$(dirname "$0")/common.sh"
+
+port=25150
+for store in table wire; do
+  options="--segment-bytes 100 --replay-quantum 40"
+  [ $store = wire ] && options="$options --wire-log"
+  start server-$store "$server" --port $port $options
+  sleep 0.5
+  { for i in $(seq 10); do echo date; sleep 0.2; done; sleep 0.5; echo logout; } \
+    | run client1-$store "$client" --server 127.0.0.1:$port
+  expect client1-$store "sequenced (10)"
+
+  { sleep 1; echo logout; } | run client2-$store "$client" --server 127.0.0.1:$port
+  expect server-$store "replay of 10 messages completed"
+  sequenced=$(grep -o 'sequenced ([0-9]*)' "$scratch/client2-$store.log" | tr -dc '0-9\n' | tr '\n' ' ')
+  [ "$sequenced" = "1 2 3 4 5 6 7 8 9 10 " ] || fail "$store: replayed $sequenced"
+  port=$((port + 1))
+done
+echo "replay: ok"
@@ -0,0 +1,61 @@
+#!/bin/sh
+# soupstock - a soupbintcp library
+#
+# Copyright 2025 Krister Joas
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Logs in below the retention floor and checks that the accept carries the
+# first sequence number still available, that the replay is numbered from it
+# and that the client's store continues from it.
+#
+#   retention.sh SERVER CLIENT
+
+. "$(dirname "$0")/common.sh"
+
+port=25110
+
+# Every message rolls the store over and only the last two segments are kept,
+# so after five messages the oldest one left is message 5.
+start server "$server" --port $port --segment-bytes 1 --segments 2
+server_pid=$!
+sleep 0.5
+
+{ for i in 1 2 3 4 5; do echo date; sleep 0.2; done; sleep 0.5; echo logout; } | run client1 "$client" --server 127.0.0.1:$port
+expect client1 "sequenced (5)"
+
+# A new client asks for message 1.
+{ sleep 1; echo logout; } | run client2 "$client" --server 127.0.0.1:$port
+expect server "(1-4) no longer available, starting at (5)"
+expect client2 'login accept ("session1", "5")'
+expect client2 "gap (1-4), messages not available"
+expect client2 "sequenced (5)"
+
+# The store continues at the advertised sequence number, so the same client
+# asks for message 6 next time and gets nothing again.
+{ sleep 1; echo logout; } | run client2 "$client" --server 127.0.0.1:$port
+expect client2 "load: (5)"
+expect client2 'login accept ("session1", "6")'
+grep -qF "sequenced (" "$scratch/client2.log" && fail "expected no replay to client2"
+
+# A crash in the middle of a rollover leaves the next segment without its
+# segment row. After a restart it continues the numbering rather than
+# starting at one again.
+kill -9 $server_pid
+last=$(ls "$scratch/server" | sed -n 's/^server-session1\.db\.\([0-9]*\)$/\1/p' | sort -n | tail -1)
+: > "$scratch/server/server-session1.db.$((last + 1))"
+start server "$server" --port $port --segment-bytes 1 --segments 2
+sleep 0.5
+{ echo date; sleep 0.5; echo logout; } | run client1 "$client" --server 127.0.0.1:$port
+expect server "sequenced (6)"
+echo "retention: ok"